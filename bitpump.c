@@ -0,0 +1,94 @@
+/* Message bits go LSB first, k of them per group
+* Both pumps buffer 64 bits to touch memory a word at a time */
+
+static inline uint64_t load_le64(const uint8_t *src) {
+    uint64_t word = 0;
+    for (unsigned i = 0; i < sizeof(uint64_t); i++)
+        word |= (uint64_t) src[i] << (8 * i);
+    return word;
+}
+
+struct bit_reader {
+    const uint8_t* data;
+    size_t size;
+    size_t pos;
+
+    uint64_t buf;
+    unsigned avail;
+
+    /* Bits past this limit are read as zeros */
+    uint64_t left;
+};
+
+/* Reads bits [bit, end) of data, bit should be a multiple of 8 */
+static void bit_reader_init(struct bit_reader* r, const char* data, size_t size, uint64_t bit, uint64_t end) {
+    r->data = (const uint8_t*) data, r->size = size,
+    r->pos = (size_t) (bit / 8),
+    r->buf = 0, r->avail = 0,
+    r->left = end - bit;
+}
+
+static inline void bit_refill(struct bit_reader* r) {
+    if (r->pos + sizeof(uint64_t) <= r->size) {
+        /* Bits loaded above avail are the same ones the next refill brings */
+        r->buf |= load_le64(r->data + r->pos) << r->avail;
+        r->pos += (63 - r->avail) >> 3;
+        r->avail |= 56;
+    } else
+        while (r->avail <= 56 && r->pos < r->size)
+            r->buf |= (uint64_t) r->data[r->pos++] << r->avail, r->avail += 8;
+}
+
+/* Takes next k <= 32 bits */
+static inline unsigned bit_read(struct bit_reader* r, unsigned k) {
+    if (r->avail < k)
+        bit_refill(r);
+
+    const unsigned take = (k < r->left) ? k : (unsigned) r->left;
+    const unsigned value = (unsigned) (r->buf & (((uint64_t) 1 << take) - 1));
+
+    /* The data end could leave less than k bits buffered */
+    const unsigned shift = (k < r->avail) ? k : r->avail;
+    r->buf >>= shift, r->avail -= shift;
+    r->left -= take;
+
+    return value;
+}
+
+struct bit_writer {
+    uint8_t* data;
+    size_t pos;
+
+    uint64_t buf;
+    unsigned used;
+
+    /* Bits past this limit are dropped */
+    uint64_t left;
+};
+
+/* Writes bits [bit, end) of data, bit should be a multiple of 8 */
+static void bit_writer_init(struct bit_writer* w, char* data, uint64_t bit, uint64_t end) {
+    w->data = (uint8_t*) data,
+    w->pos = (size_t) (bit / 8),
+    w->buf = 0, w->used = 0,
+    w->left = end - bit;
+}
+
+/* Puts k <= 32 bits */
+static inline void bit_write(struct bit_writer* w, unsigned value, unsigned k) {
+    const unsigned take = (k < w->left) ? k : (unsigned) w->left;
+
+    w->buf |= (uint64_t) (value & (((uint64_t) 1 << take) - 1)) << w->used;
+    w->used += take, w->left -= take;
+
+    if (w->used >= 32) {
+        for (unsigned i = 0; i < 4; i++)
+            w->data[w->pos++] = (uint8_t) (w->buf >> (8 * i));
+        w->buf >>= 32, w->used -= 32;
+    }
+}
+
+static void bit_flush(struct bit_writer* w) {
+    for (; w->used; w->used = (w->used > 8) ? w->used - 8 : 0, w->buf >>= 8)
+        w->data[w->pos++] = (uint8_t) w->buf;
+}
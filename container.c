@@ -1,8 +1,15 @@
 #include <jpeg/jpeglib.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "md5.h"
 
 #define MD5_SIZE 16
-enum SOURCE { FILE_SRC, MEM_SRC };
+
+/* Mapped files share the fs part with the stream ones, only the way of reading them differs */
+enum SOURCE { FILE_SRC, MEM_SRC, MMAP_SRC };
 
 #define get_row(dct_arrays, dstruct, row_id)\
 dstruct.mem->access_virt_barray(\
@@ -10,28 +17,136 @@ dstruct.mem->access_virt_barray(\
     row_id, (JDIMENSION) 1, FALSE\
 )[0]
 
+/* Reads the container for libjpeg either from its stream, hashing everything read if asked to,
+* or from its bytes. Lives with the decoder, so a reused decoder never allocates a new source */
+struct container_src {
+    struct jpeg_source_mgr pub;
+    FILE *stream;
+    JOCTET *buffer;
+
+    bool hashing;
+    uint8_t hash;
+    md5_ctx md5;
+    uint8_t last[MD5_SIZE];
+};
+
+#define CONTAINER_SRC_SIZE (1 << 16)
+
+static const JOCTET container_eoi[2] = {(JOCTET) 0xFF, (JOCTET) JPEG_EOI};
+
+static size_t container_src_read(struct container_src *src) {
+    const size_t read = fread(src->buffer, 1, CONTAINER_SRC_SIZE, src->stream);
+
+    if (src->hashing) {
+        md5_update(&src->md5, src->buffer, read);
+        if (src->hash == F5AR_HASH_LEGACY)
+            md5_keep_last(src->last, src->buffer, read);
+    }
+
+    return read;
+}
+
+static void container_src_init(j_decompress_ptr cinfo) {
+    (void) cinfo;
+}
+
+static boolean container_src_fill(j_decompress_ptr cinfo) {
+    struct container_src *src = (struct container_src *) cinfo->src;
+    const size_t read = src->stream ? container_src_read(src) : 0;
+
+    /* Truncated file ends with a fake EOI marker, the same way the stdio source does it */
+    if (!read)
+        src->pub.next_input_byte = container_eoi,
+        src->pub.bytes_in_buffer = sizeof(container_eoi);
+    else
+        src->pub.next_input_byte = src->buffer,
+        src->pub.bytes_in_buffer = read;
+
+    return TRUE;
+}
+
+static void container_src_skip(j_decompress_ptr cinfo, long num_bytes) {
+    struct jpeg_source_mgr *src = cinfo->src;
+
+    while (num_bytes > (long) src->bytes_in_buffer) {
+        num_bytes -= (long) src->bytes_in_buffer;
+        container_src_fill(cinfo);
+    }
+
+    if (num_bytes > 0)
+        src->next_input_byte += num_bytes,
+        src->bytes_in_buffer -= (size_t) num_bytes;
+}
+
+static void container_src_term(j_decompress_ptr cinfo) {
+    (void) cinfo;
+}
+
+/* Either the stream read through the buffer or the bytes are decoded */
+static void container_src_setup(j_decompress_ptr cinfo, struct container_src *src, FILE *stream, JOCTET *buffer,
+                                const unsigned char *bytes, size_t size, bool hashing, uint8_t hash) {
+    src->pub.init_source = container_src_init,
+    src->pub.fill_input_buffer = container_src_fill,
+    src->pub.skip_input_data = container_src_skip,
+    src->pub.resync_to_restart = jpeg_resync_to_restart,
+    src->pub.term_source = container_src_term;
+    src->pub.next_input_byte = bytes, src->pub.bytes_in_buffer = size;
+
+    src->stream = stream, src->buffer = buffer;
+    src->hashing = hashing, src->hash = hash;
+    md5_init(&src->md5);
+    memset(src->last, 0, MD5_SIZE);
+
+    cinfo->src = &src->pub;
+}
+
+/* Hashes whatever libjpeg left unread and compares the digest with the expected one */
+static bool container_src_check(struct container_src *src, const char *expected) {
+    while (container_src_read(src));
+
+    char digest[MD5_SIZE];
+    if (src->hash == F5AR_HASH_LEGACY)
+        md5_final_legacy((uint8_t *) digest, &src->md5, src->last);
+    else
+        md5_final((uint8_t *) digest, &src->md5);
+
+    return !memcmp(digest, expected, MD5_SIZE);
+}
+
+struct container_jpeg {
+    jvirt_barray_ptr *dct_arrays;
+    struct jpeg_decompress_struct dstruct;
+    struct container_src src;
+};
+
 typedef struct {
+    /* Nonzero coefficients of the first component in the scan order,
+    * built on demand so groups are formed without walking the zeros */
     struct {
-        JDIMENSION row_id;
-        JDIMENSION block_id;
-        JDIMENSION coeff_id;
-
-        JBLOCKROW row;
+        JCOEF **coeffs;
 
+        size_t size;
         size_t pos;
-    } dct;
+    } nz;
 
-    struct {
-        jvirt_barray_ptr *dct_arrays;
-        struct jpeg_decompress_struct dstruct;
-    } jpeg;
+    /* Decoder state exists only while the container is open, which keeps idle containers small */
+    struct container_jpeg *jpeg;
 
     struct {
         int type;
         union {
+            /* No descriptor is kept between uses, the path is opened whenever the file is read or written,
+            * so at most one handle per worker is open however large the library is */
             struct {
-                FILE *stream;
                 char *path;
+
+                /* Whole file read while it was hashed, decoded instead of the file */
+                unsigned char *bytes;
+                size_t bytes_size;
+
+                /* Hash was given by the caller, so check it with this kind of hash while decoding */
+                bool verify;
+                uint8_t verify_with;
             } fs;
             struct {
                 void *ptr;
@@ -43,116 +158,513 @@ typedef struct {
     size_t size;
     bool is_active;
 
+    f5archive_capacity capacity;
+    bool analyzed;
+
+    /* Part of the message carried by the container in the segmented layout */
+    struct {
+        uint64_t offset;
+        uint64_t bits;
+    } segment;
+
     char hash[MD5_SIZE];
 } container_t;
 
-#define dct_get(iterator) iterator.row[iterator.block_id][iterator.coeff_id]
+#define nz_exhausted(container) ((container)->nz.pos == (container)->nz.size)
+#define nz_next(container) ((container)->nz.coeffs[(container)->nz.pos++])
 
-int c_next(container_t* container) {
-    container->dct.pos++;
-    container->dct.coeff_id++;
+/* Nonzero coefficients are counted first, so the list takes no more than they need */
+int container_index(container_t *container) {
+    if (container->nz.coeffs) {
+        container->nz.pos = 0;
+        return F5AR_OK;
+    }
 
-    if (container->dct.pos == container->size)
-        return F5AR_FAILURE;
+    const JDIMENSION height_in_blocks = container->jpeg->dstruct.comp_info[0].height_in_blocks;
+    const JDIMENSION width_in_blocks = container->jpeg->dstruct.comp_info[0].width_in_blocks;
 
-    if (container->dct.coeff_id == DCTSIZE2) {
-        container->dct.coeff_id = 0;
-        container->dct.block_id++;
+    size_t size = 0;
+    for (JDIMENSION row_id = 0; row_id < height_in_blocks; row_id++) {
+        JBLOCKROW row = get_row(container->jpeg->dct_arrays, container->jpeg->dstruct, row_id);
 
-        if (container->dct.block_id == container->jpeg.dstruct.comp_info[0].width_in_blocks) {
-            container->dct.block_id = 0;
-            container->dct.row_id++;
+        for (JDIMENSION block_id = 0; block_id < width_in_blocks; block_id++)
+            for (unsigned i = 0; i < DCTSIZE2; i++)
+                size += row[block_id][i] != 0;
+    }
 
-            container->dct.row = get_row(
-                    container->jpeg.dct_arrays,
-                    container->jpeg.dstruct,
-                    container->dct.row_id
-            );
-        }
+    JCOEF **coeffs = malloc(sizeof(JCOEF*) * (size ? size : 1));
+    if (!coeffs)
+        return F5AR_MALLOC_ERR;
+
+    size_t pos = 0;
+    for (JDIMENSION row_id = 0; row_id < height_in_blocks; row_id++) {
+        JBLOCKROW row = get_row(container->jpeg->dct_arrays, container->jpeg->dstruct, row_id);
+
+        for (JDIMENSION block_id = 0; block_id < width_in_blocks; block_id++)
+            for (unsigned i = 0; i < DCTSIZE2; i++)
+                if (row[block_id][i] != 0)
+                    coeffs[pos++] = &row[block_id][i];
     }
 
+    container->nz.coeffs = coeffs,
+    container->nz.size = size,
+    container->nz.pos = 0;
+
     return F5AR_OK;
 }
 
-int container_open(container_t *container, struct jpeg_error_mgr* jerr) {
-    if (container->is_active)
-        return F5AR_OK;
+static void container_unindex(container_t *container) {
+    free(container->nz.coeffs);
+    memset(&container->nz, 0, sizeof(container->nz));
+}
+
+/* Descriptor is closed right away, the mapping outlives it */
+static int container_map(const char *path, unsigned char **bytes, size_t *size) {
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return F5AR_FILEIO_ERR;
+
+    struct stat st;
+    void *addr = MAP_FAILED;
+    if (!fstat(fd, &st) && st.st_size > 0)
+        addr = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (addr == MAP_FAILED)
+        return F5AR_FILEIO_ERR;
+
+    *bytes = addr, *size = (size_t) st.st_size;
+    return F5AR_OK;
+}
+
+static void container_unmap(unsigned char *bytes, size_t size) {
+    if (bytes)
+        munmap(bytes, size);
+}
+
+/* Lets the kernel start reading the file into the page cache, it stays there after closing the file */
+static void container_advise(const char *path) {
+#ifdef POSIX_FADV_WILLNEED
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return;
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
+#endif
+}
+
+static void container_release_bytes(container_t *container) {
+    if (container->src.type != FILE_SRC)
+        return;
+
+    free(container->src.fs.bytes);
+    container->src.fs.bytes = NULL, container->src.fs.bytes_size = 0;
+}
+
+static int container_hash_stream(FILE *stream, char *dest, uint8_t hash) {
+    return (hash == F5AR_HASH_LEGACY) ? md5_file_legacy(stream, dest) : md5_file(stream, dest);
+}
+
+static void container_hash_bytes(const unsigned char *bytes, size_t size, char *dest, uint8_t hash) {
+    md5_ctx md5;
+    md5_init(&md5);
+    md5_update(&md5, bytes, size);
+
+    if (hash == F5AR_HASH_LEGACY) {
+        uint8_t last[MD5_SIZE];
+        memset(last, 0, MD5_SIZE);
+
+        md5_keep_last(last, bytes, size);
+        md5_final_legacy((uint8_t *) dest, &md5, last);
+    } else
+        md5_final((uint8_t *) dest, &md5);
+}
+
+/* Plain digests of many buffers come from the multi-lane MD5 at once, legacy ones are computed one by one */
+static void container_hash_batch(const unsigned char *const *srcs, const size_t *sizes, size_t count,
+                                 char (*dests)[MD5_SIZE], uint8_t hash) {
+    if (hash != F5AR_HASH_LEGACY) {
+        md5_buffers_batch((const void *const *) srcs, sizes, count, dests);
+        return;
+    }
+
+    for (size_t i = 0; i < count; i++)
+        container_hash_bytes(srcs[i], sizes[i], dests[i], hash);
+}
+
+/* Writes the encoded container to its stream and hashes the bytes on their way out,
+* so the hash is ready when the compression finishes */
+#define HASHING_DEST_SIZE (1 << 16)
+
+struct hashing_dest {
+    struct jpeg_destination_mgr pub;
+    FILE *stream;
+
+    uint8_t hash;
+    md5_ctx md5;
+    uint8_t last[MD5_SIZE];
+
+    bool failed;
+    JOCTET buffer[HASHING_DEST_SIZE];
+};
+
+static void hashing_dest_write(struct hashing_dest *dest, size_t size) {
+    if (fwrite(dest->buffer, 1, size, dest->stream) != size)
+        dest->failed = true;
+
+    md5_update(&dest->md5, dest->buffer, size);
+    if (dest->hash == F5AR_HASH_LEGACY)
+        md5_keep_last(dest->last, dest->buffer, size);
+
+    dest->pub.next_output_byte = dest->buffer,
+    dest->pub.free_in_buffer = HASHING_DEST_SIZE;
+}
+
+static void hashing_dest_init(j_compress_ptr cinfo) {
+    struct hashing_dest *dest = (struct hashing_dest *) cinfo->dest;
+    dest->pub.next_output_byte = dest->buffer,
+    dest->pub.free_in_buffer = HASHING_DEST_SIZE;
+}
+
+static boolean hashing_dest_empty(j_compress_ptr cinfo) {
+    hashing_dest_write((struct hashing_dest *) cinfo->dest, HASHING_DEST_SIZE);
+    return TRUE;
+}
+
+static void hashing_dest_term(j_compress_ptr cinfo) {
+    struct hashing_dest *dest = (struct hashing_dest *) cinfo->dest;
+    hashing_dest_write(dest, HASHING_DEST_SIZE - dest->pub.free_in_buffer);
+
+    if (fflush(dest->stream))
+        dest->failed = true;
+}
+
+static void hashing_dest_setup(struct hashing_dest *dest, FILE *stream, uint8_t hash) {
+    dest->pub.init_destination = hashing_dest_init,
+    dest->pub.empty_output_buffer = hashing_dest_empty,
+    dest->pub.term_destination = hashing_dest_term;
+
+    dest->stream = stream, dest->hash = hash, dest->failed = false;
+    md5_init(&dest->md5);
+    memset(dest->last, 0, MD5_SIZE);
+}
+
+static void hashing_dest_finish(struct hashing_dest *dest, char *result) {
+    if (dest->hash == F5AR_HASH_LEGACY)
+        md5_final_legacy((uint8_t *) result, &dest->md5, dest->last);
+    else
+        md5_final((uint8_t *) result, &dest->md5);
+}
+
+/* Every thread keeps a few decoders of closed containers, the compressor and the I/O buffers,
+* so opening and packing another container costs no libjpeg setup. jpeg_finish_*() and
+* jpeg_abort_*() free the image pools, leaving the objects ready for the next container */
+#define CONTAINER_SPARE_DECODERS 4
+
+struct container_scratch {
+    struct container_jpeg *spare[CONTAINER_SPARE_DECODERS];
+    unsigned spares;
+
+    struct jpeg_compress_struct cstruct;
+    bool has_cstruct;
+
+    /* Objects outliving the archive report to their own manager when destroyed */
+    struct jpeg_error_mgr err;
+
+    struct hashing_dest dest;
+    JOCTET buffer[CONTAINER_SRC_SIZE];
+};
+
+static pthread_key_t container_scratch_key;
+static pthread_once_t container_scratch_once = PTHREAD_ONCE_INIT;
+
+static void container_scratch_free(void *arg) {
+    struct container_scratch *scratch = arg;
+
+    while (scratch->spares) {
+        struct container_jpeg *jpeg = scratch->spare[--scratch->spares];
+        jpeg->dstruct.err = &scratch->err;
+        jpeg_destroy_decompress(&jpeg->dstruct), free(jpeg);
+    }
+
+    if (scratch->has_cstruct)
+        scratch->cstruct.err = &scratch->err, jpeg_destroy_compress(&scratch->cstruct);
+    free(scratch);
+}
+
+static void container_scratch_setup(void) {
+    pthread_key_create(&container_scratch_key, container_scratch_free);
+}
+
+static struct container_scratch *container_scratch(void) {
+    pthread_once(&container_scratch_once, container_scratch_setup);
+
+    struct container_scratch *scratch = pthread_getspecific(container_scratch_key);
+    if (scratch || !(scratch = malloc(sizeof(struct container_scratch))))
+        return scratch;
+
+    scratch->spares = 0, scratch->has_cstruct = false;
+    jpeg_std_error(&scratch->err);
+
+    if (pthread_setspecific(container_scratch_key, scratch)) {
+        free(scratch);
+        return NULL;
+    }
+
+    return scratch;
+}
+
+/* Worker threads free their scratch on exit, the calling thread should do it by itself */
+static void container_scratch_release(void) {
+    pthread_once(&container_scratch_once, container_scratch_setup);
+
+    struct container_scratch *scratch = pthread_getspecific(container_scratch_key);
+    if (scratch)
+        container_scratch_free(scratch), pthread_setspecific(container_scratch_key, NULL);
+}
+
+static struct container_jpeg *container_take_jpeg(struct container_scratch *scratch, struct jpeg_error_mgr *jerr) {
+    if (scratch->spares) {
+        struct container_jpeg *jpeg = scratch->spare[--scratch->spares];
+        jpeg->dstruct.err = jpeg_std_error(jerr);
+        return jpeg;
+    }
+
+    struct container_jpeg *jpeg = malloc(sizeof(struct container_jpeg));
+    if (!jpeg)
+        return NULL;
+
+    jpeg->dstruct.err = jpeg_std_error(jerr);
+    jpeg_create_decompress(&jpeg->dstruct);
+    return jpeg;
+}
+
+/* Decoder should be finished or aborted already */
+static void container_free_jpeg(container_t *container) {
+    struct container_scratch *scratch = container_scratch();
+    if (scratch && scratch->spares < CONTAINER_SPARE_DECODERS)
+        scratch->spare[scratch->spares++] = container->jpeg;
+    else
+        jpeg_destroy_decompress(&container->jpeg->dstruct), free(container->jpeg);
+
+    container->jpeg = NULL;
+}
+
+int container_open(container_t *container, struct jpeg_error_mgr* jerr, bool index) {
+    /* Container could be left open by another thread, so report errors to the caller */
+    if (container->is_active) {
+        container->jpeg->dstruct.err = jpeg_std_error(jerr);
+        return index ? container_index(container) : F5AR_OK;
+    }
+
+    struct container_scratch *scratch = container_scratch();
+    if (!scratch || !(container->jpeg = container_take_jpeg(scratch, jerr)))
+        return F5AR_MALLOC_ERR;
+
+    j_decompress_ptr dstruct = &container->jpeg->dstruct;
+
+    /* Opened just for the decoding, the coefficients are all in memory once it is done */
+    FILE *stream = NULL;
+    unsigned char *bytes = container->src.type != MEM_SRC ? container->src.fs.bytes : NULL;
+    size_t bytes_size = container->src.type != MEM_SRC ? container->src.fs.bytes_size : 0;
+    unsigned char *mapping = NULL;
 
-    container->jpeg.dstruct.err = jpeg_std_error(jerr);
-    jpeg_create_decompress(&container->jpeg.dstruct);
     switch (container->src.type) {
         case FILE_SRC:
-            jpeg_stdio_src(&container->jpeg.dstruct, container->src.fs.stream);
+        case MMAP_SRC:
+            if (!bytes && container->src.type == MMAP_SRC) {
+                if (container_map(container->src.fs.path, &mapping, &bytes_size)) {
+                    container_free_jpeg(container);
+                    return F5AR_FILEIO_ERR;
+                }
+                bytes = mapping;
+            } else if (!bytes && !(stream = fopen(container->src.fs.path, "rb"))) {
+                container_free_jpeg(container);
+                return F5AR_FILEIO_ERR;
+            }
+
+            container_src_setup(dstruct, &container->jpeg->src, stream, scratch->buffer, bytes, bytes_size,
+                                stream && container->src.fs.verify, container->src.fs.verify_with);
             break;
         case MEM_SRC:
-            jpeg_mem_src(&container->jpeg.dstruct, container->src.mem.ptr, *container->src.mem.size);
+            container_src_setup(dstruct, &container->jpeg->src, NULL, NULL,
+                                container->src.mem.ptr, *container->src.mem.size, false, 0);
             break;
     }
 
-    jpeg_read_header(&container->jpeg.dstruct, TRUE);
+    jpeg_read_header(dstruct, TRUE);
 
-    const size_t height_in_blocks = container->jpeg.dstruct.comp_info[0].height_in_blocks;
-    const size_t width_in_blocks = container->jpeg.dstruct.comp_info[0].width_in_blocks;
+    const size_t height_in_blocks = dstruct->comp_info[0].height_in_blocks;
+    const size_t width_in_blocks = dstruct->comp_info[0].width_in_blocks;
 
     container->size = width_in_blocks * DCTSIZE2 * height_in_blocks;
-    container->jpeg.dct_arrays = jpeg_read_coefficients(&container->jpeg.dstruct);
+    container->jpeg->dct_arrays = jpeg_read_coefficients(dstruct);
+
+    if (container->src.type != MEM_SRC && container->src.fs.verify) {
+        bool valid;
+        if (stream)
+            valid = container_src_check(&container->jpeg->src, container->hash);
+        else {
+            char digest[MD5_SIZE];
+            container_hash_bytes(bytes, bytes_size, digest, container->src.fs.verify_with);
+            valid = !memcmp(digest, container->hash, MD5_SIZE);
+        }
+
+        if (!valid) {
+            jpeg_abort_decompress(dstruct), container_free_jpeg(container);
+            if (stream)
+                fclose(stream);
+            container_unmap(mapping, bytes_size);
+            return F5AR_HASH_MISMATCH;
+        }
+
+        /* Hashed once, that is enough */
+        container->src.fs.verify = false;
+    }
 
-    /* Reset the iterator */
-    memset(&container->dct, 0, sizeof(container->dct));
-    container->dct.row = get_row(container->jpeg.dct_arrays, container->jpeg.dstruct, 0);
+    /* Nothing is read past the coefficients, so the buffer goes back to the thread */
+    container->jpeg->src.stream = NULL, container->jpeg->src.buffer = NULL;
+    if (stream)
+        fclose(stream);
+    container_unmap(mapping, bytes_size);
 
     container->is_active = true;
+    return index ? container_index(container) : F5AR_OK;
+}
+
+/* Hash of the container as is, for containers left untouched by the packing */
+int container_hash(container_t *container, uint8_t hash) {
+    switch (container->src.type) {
+        case MMAP_SRC: {
+            unsigned char *bytes;
+            size_t size;
+            if (container_map(container->src.fs.path, &bytes, &size))
+                return F5AR_IO_ERR;
+
+            container_hash_bytes(bytes, size, container->hash, hash);
+            container_unmap(bytes, size);
+        } break;
+
+        case FILE_SRC: {
+            if (container->src.fs.bytes) {
+                container_hash_bytes(container->src.fs.bytes, container->src.fs.bytes_size, container->hash, hash);
+                break;
+            }
+
+            FILE *stream = fopen(container->src.fs.path, "rb");
+            const int err = !stream || container_hash_stream(stream, container->hash, hash);
+            if (stream)
+                fclose(stream);
+            if (err)
+                return F5AR_IO_ERR;
+        } break;
+
+        case MEM_SRC:
+            md5_buffer(container->src.mem.ptr, *container->src.mem.size, container->hash);
+            break;
+    }
+
     return F5AR_OK;
 }
 
+/* Memory held by the decoded coefficients of every component */
+size_t container_footprint(container_t *container) {
+    size_t footprint = 0;
+    for (int ci = 0; ci < container->jpeg->dstruct.num_components; ci++)
+        footprint += (size_t) container->jpeg->dstruct.comp_info[ci].width_in_blocks *
+                container->jpeg->dstruct.comp_info[ci].height_in_blocks * sizeof(JBLOCK);
+
+    return footprint;
+}
+
 void container_close_discard(container_t *container) {
     container->is_active = false;
+    container_unindex(container);
 
-    jpeg_finish_decompress(&container->jpeg.dstruct);
-    jpeg_destroy_decompress(&container->jpeg.dstruct);
-
-    if (container->src.type == FILE_SRC)
-        fseek(container->src.fs.stream, 0, SEEK_SET);
+    jpeg_finish_decompress(&container->jpeg->dstruct);
+    container_free_jpeg(container);
+    container_release_bytes(container);
 }
 
-int container_close_keep(container_t *container, struct jpeg_error_mgr* jerr) {
-    struct jpeg_compress_struct cstruct;
-    cstruct.err = jpeg_std_error(jerr);
+/* Writes the container back, hashing the bytes as they are written instead of reading the file again
+* Read files are reopened for writing, mapped ones are written to a temporary file renamed over them */
+int container_close_keep(container_t *container, struct jpeg_error_mgr* jerr, uint8_t hash) {
+    struct container_scratch *scratch = container_scratch();
+    if (!scratch)
+        return F5AR_MALLOC_ERR;
 
-    jpeg_create_compress(&cstruct);
-    jpeg_copy_critical_parameters(&container->jpeg.dstruct, &cstruct);
+    /* Mapped file could still be read through mappings of other processes,
+    * so the new one is written aside and renamed over it */
+    char *written = NULL;
+    FILE *out = NULL;
 
     switch (container->src.type) {
         case FILE_SRC:
-            container->src.fs.stream = freopen(container->src.fs.path, "wb", container->src.fs.stream);
-            if (!container->src.fs.stream)
+            if (!(out = fopen(container->src.fs.path, "wb")))
                 return F5AR_IO_ERR;
+            break;
 
-            jpeg_stdio_dest(&cstruct, container->src.fs.stream);
+        case MMAP_SRC:
+            if (!(written = malloc(strlen(container->src.fs.path) + sizeof(".f5ar~"))))
+                return F5AR_MALLOC_ERR;
+
+            strcpy(written, container->src.fs.path), strcat(written, ".f5ar~");
+            if (!(out = fopen(written, "wb"))) {
+                free(written);
+                return F5AR_IO_ERR;
+            }
             break;
 
         case MEM_SRC:
-            jpeg_mem_dest(&cstruct, container->src.mem.ptr, container->src.mem.size);
             break;
     }
 
-    jpeg_write_coefficients(&cstruct, container->jpeg.dct_arrays);
-    jpeg_finish_compress(&cstruct), jpeg_destroy_compress(&cstruct);
-
-    switch (container->src.type) {
-        case FILE_SRC:
-            container->src.fs.stream = freopen(container->src.fs.path, "rb", container->src.fs.stream);
-            md5_file(container->src.fs.stream, container->hash);
-            break;
+    /* libjpeg ties a compressor to the kind of its destination, so memory ones get their own */
+    struct jpeg_compress_struct mem_cstruct;
+    j_compress_ptr cstruct = out ? &scratch->cstruct : &mem_cstruct;
+
+    cstruct->err = jpeg_std_error(jerr);
+    if (!out || !scratch->has_cstruct)
+        jpeg_create_compress(cstruct);
+
+    if (out)
+        scratch->has_cstruct = true,
+        hashing_dest_setup(&scratch->dest, out, hash), cstruct->dest = &scratch->dest.pub;
+    else
+        jpeg_mem_dest(cstruct, container->src.mem.ptr, container->src.mem.size);
+
+    jpeg_copy_critical_parameters(&container->jpeg->dstruct, cstruct);
+    jpeg_write_coefficients(cstruct, container->jpeg->dct_arrays);
+    jpeg_finish_compress(cstruct);
+
+    int err = F5AR_OK;
+    if (out) {
+        hashing_dest_finish(&scratch->dest, container->hash);
+        if (fclose(out) || scratch->dest.failed)
+            err = F5AR_IO_ERR;
+    } else {
+        jpeg_destroy_compress(cstruct);
+        md5_buffer(container->src.mem.ptr, *container->src.mem.size, container->hash);
+    }
 
-        case MEM_SRC:
-            md5_buffer(container->src.mem.ptr, *container->src.mem.size, container->hash);
-            break;
+    if (written) {
+        struct stat st;
+        if (!err && !stat(container->src.fs.path, &st))
+            chmod(written, st.st_mode & 07777);
+        if (err || rename(written, container->src.fs.path))
+            remove(written), err = F5AR_IO_ERR;
+        free(written);
     }
 
-    jpeg_finish_decompress(&container->jpeg.dstruct),
-            jpeg_destroy_decompress(&container->jpeg.dstruct);
+    jpeg_finish_decompress(&container->jpeg->dstruct);
+    container_free_jpeg(container);
+    container_release_bytes(container);
+
+    /* Embedding changed the coefficients */
+    container->analyzed = false;
 
     container->is_active = false;
-    return F5AR_OK;
+    container_unindex(container);
+    return err;
 }
\ No newline at end of file
@@ -6,6 +6,9 @@
 * Distributed under the Simplified BSD License
 */
 
+/* syscall() used by the io_uring reads is not a part of C99 */
+#define _DEFAULT_SOURCE
+
 #include "f5ar.h"
 
 #include <stdbool.h>
@@ -14,105 +17,315 @@
 
 #include "md5.h"
 #include "container.c"
+#include "parallel.c"
+#include "prefetch.c"
+#include "syndrome.c"
+#include "bitpump.c"
+
+/* Ends chains of container ids */
+#define NO_CONTAINER UINT32_MAX
+
+/* Imported containers waiting for their sources, keyed by hash of the first of them
+* Twins are filled in the order they were imported */
+struct waiting_slot {
+    uint32_t first;
+    uint32_t next;
+};
 
-struct linked_container {
-    struct linked_container* next;
-    container_t container;
+/* Paths are copied into blocks that are never moved, so containers keep plain pointers to them */
+#define PATH_BLOCK_SIZE (1 << 16)
+
+struct path_block {
+    struct path_block* prev;
+    size_t used, size;
+    char data[];
 };
 
 struct f5archive_ctx {
-    struct linked_container* head;
-    struct linked_container* tail;
+    /* Containers in the order, addressed by their ids */
+    container_t* containers;
+    uint32_t reserved;
+
+    struct path_block* paths;
 
     struct jpeg_error_mgr err;
 
+    /* One error manager per worker thread */
+    struct jpeg_error_mgr* errs;
+    unsigned threads;
+
+    struct parallel_pool pool;
+
+    /* Containers decoded by the analysis are kept open for the packing up to the limit */
+    size_t cache_limit;
+    size_t cached;
+
+    /* Files added or filled are mapped instead of being opened as streams */
+    bool mapped;
+
+    /* Library files read in the background ahead of the workers, 0 reads them when they are needed */
+    unsigned read_ahead;
+
+    /* Kernel is asked to read this many containers ahead of the decoding, advised is the next one to ask for */
+    unsigned advise;
+    size_t advised;
+
+    pthread_mutex_t lock;
+
     /* Even 64-bit servers should not be able to handle more than
     * 2^32 * |C| bytes for at least a decade */
     uint32_t size;
     uint32_t filled;
 
     uint32_t used;
+
+    /* Packing goes through the needed containers only once f5ar_analyze_for() found the rest unneeded */
+    bool bounded;
+    uint32_t needed;
+
+    struct waiting_slot* waiting;
+    size_t waiting_size;
+
+    /* Next imported container with the same hash for every container */
+    uint32_t* twins;
 };
 
 int f5ar_init(f5archive* archive) {
-    archive->ctx = (archive->ctx ? archive->ctx : calloc(sizeof(struct f5archive_ctx), 1));
+    if (archive->ctx)
+        return F5AR_OK;
+
+    archive->ctx = calloc(sizeof(struct f5archive_ctx), 1);
     if (!archive->ctx)
         return F5AR_MALLOC_ERR;
 
+    if (pthread_mutex_init(&archive->ctx->lock, NULL)) {
+        free(archive->ctx), archive->ctx = NULL;
+        return F5AR_FAILURE;
+    }
+
+    syndrome_init();
+    return f5ar_set_threads(archive, 1);
+}
+
+int f5ar_set_threads(f5archive *archive, unsigned threads) {
+    if (!archive->ctx)
+        return F5AR_NOT_INITIALIZED;
+
+    threads = threads ? threads : parallel_threads_online();
+    if (threads == archive->ctx->threads)
+        return F5AR_OK;
+
+    struct jpeg_error_mgr* errs = calloc(sizeof(struct jpeg_error_mgr), threads);
+    if (!errs)
+        return F5AR_MALLOC_ERR;
+
+    /* Archive stays usable by the calling thread alone if the new pool fails */
+    parallel_pool_free(&archive->ctx->pool);
+    const int err = parallel_pool_init(&archive->ctx->pool, threads);
+
+    free(archive->ctx->errs);
+    archive->ctx->errs = errs,
+    archive->ctx->threads = threads;
+
+    return err;
+}
+
+int f5ar_set_cache_limit(f5archive *archive, size_t bytes) {
+    if (!archive->ctx)
+        return F5AR_NOT_INITIALIZED;
+
+    archive->ctx->cache_limit = bytes;
+    return F5AR_OK;
+}
+
+int f5ar_set_mapped(f5archive *archive, int mapped) {
+    if (!archive->ctx)
+        return F5AR_NOT_INITIALIZED;
+
+    archive->ctx->mapped = mapped != 0;
+    return F5AR_OK;
+}
+
+int f5ar_set_read_ahead(f5archive *archive, unsigned depth) {
+    if (!archive->ctx)
+        return F5AR_NOT_INITIALIZED;
+
+    archive->ctx->read_ahead = depth;
     return F5AR_OK;
 }
 
-static struct linked_container* append_new(f5archive *archive) {
+int f5ar_set_advise(f5archive *archive, unsigned ahead) {
     if (!archive->ctx)
+        return F5AR_NOT_INITIALIZED;
+
+    archive->ctx->advise = ahead;
+    return F5AR_OK;
+}
+
+/* Passes go through ids in order, so every file up to id + advise not advised yet is handed to the kernel
+* Paths are taken holding the context lock */
+static void advise_ahead(struct f5archive_ctx* ctx, size_t* next, size_t id, size_t count,
+                         prefetch_path_fn path, void* arg) {
+    if (!ctx->advise)
+        return;
+
+    const size_t last = (id + ctx->advise < count) ? id + ctx->advise : count - 1;
+    while (true) {
+        pthread_mutex_lock(&ctx->lock);
+        const size_t ahead = (*next <= last) ? (*next)++ : count;
+        const char* file = (ahead < count) ? path(arg, ahead) : NULL;
+        pthread_mutex_unlock(&ctx->lock);
+
+        if (ahead == count)
+            break;
+        if (file)
+            container_advise(file);
+    }
+}
+
+static const char* fs_path(void *arg, size_t id) {
+    const container_t* container = &((struct f5archive_ctx*) arg)->containers[id];
+    return (container->src.type != MEM_SRC) ? container->src.fs.path : NULL;
+}
+
+/* Call it before decoding the container id, every pass starts with advised reset */
+static void advise_containers(struct f5archive_ctx* ctx, size_t id) {
+    advise_ahead(ctx, &ctx->advised, id, ctx->size, fs_path, ctx);
+}
+
+/* Prefetched file is decoded instead of reading it again, returns false if there was none */
+static bool take_prefetched(struct prefetch* pf, container_t* container, size_t id) {
+    size_t size;
+    unsigned char* data = pf ? prefetch_take(pf, id, &size) : NULL;
+    if (!data)
+        return false;
+
+    container->src.fs.bytes = data,
+    container->src.fs.bytes_size = size;
+    return true;
+}
+
+/* Containers read from their files by the next decoding, the others are skipped by the prefetch */
+static const char* undecoded_path(void *arg, size_t id) {
+    const container_t* container = &((struct f5archive_ctx*) arg)->containers[id];
+    if (container->src.type != FILE_SRC || container->is_active || container->src.fs.bytes)
         return NULL;
 
-    if (!archive->ctx->head)
-        archive->ctx->head = calloc(sizeof(struct linked_container), 1),
-        archive->ctx->tail = archive->ctx->head;
-    else
-        archive->ctx->tail->next = calloc(sizeof(struct linked_container), 1),
-        archive->ctx->tail = archive->ctx->tail->next;
+    return container->src.fs.path;
+}
 
-    archive->ctx->size += archive->ctx->tail ? 1 : 0;
-    return archive->ctx->tail;
+static const char* unanalyzed_path(void *arg, size_t id) {
+    return ((struct f5archive_ctx*) arg)->containers[id].analyzed ? NULL : undecoded_path(arg, id);
 }
 
-static void free_tail(f5archive *archive) {
-    struct linked_container *el = archive->ctx->head;
-    while (el->next != archive->ctx->tail)
-        el = el->next;
-    archive->ctx->tail = el;
+/* Table grows twice at a time, ids of the containers stay the same */
+static container_t* append_new(f5archive *archive) {
+    struct f5archive_ctx* ctx = archive->ctx;
+    if (!ctx || ctx->size == NO_CONTAINER)
+        return NULL;
+
+    if (ctx->size == ctx->reserved) {
+        uint32_t reserved = ctx->reserved ? ctx->reserved * 2 : 64;
+        reserved = (reserved > ctx->reserved) ? reserved : NO_CONTAINER;
+
+        container_t* containers = realloc(ctx->containers, sizeof(container_t) * reserved);
+        if (!containers)
+            return NULL;
+
+        ctx->containers = containers, ctx->reserved = reserved;
+    }
 
-    free (el->next);
-    el->next = NULL;
+    container_t* container = &ctx->containers[ctx->size++];
+    memset(container, 0, sizeof(container_t));
+    return container;
+}
 
+static void free_tail(f5archive *archive) {
     archive->ctx->size--;
 }
 
-static int copy_fs_path(f5archive *archive, struct linked_container *new, const char *path) {
-    const size_t path_len = strlen(path);
-    new->container.src.fs.path = malloc(path_len + 1);
-    if (!new->container.src.fs.path) {
-        fclose(new->container.src.fs.stream);
-        free_tail(archive);
+static int copy_fs_path(struct f5archive_ctx* ctx, container_t* container, const char *path) {
+    const size_t path_size = strlen(path) + 1;
 
-        return F5AR_MALLOC_ERR;
+    struct path_block* block = ctx->paths;
+    if (!block || block->size - block->used < path_size) {
+        const size_t size = path_size > PATH_BLOCK_SIZE ? path_size : PATH_BLOCK_SIZE;
+        if (!(block = malloc(sizeof(struct path_block) + size)))
+            return F5AR_MALLOC_ERR;
+
+        block->prev = ctx->paths, block->used = 0, block->size = size;
+        ctx->paths = block;
     }
 
-    strcpy(new->container.src.fs.path, path);
-    new->container.src.fs.path[path_len] = '\0';
+    container->src.fs.path = memcpy(block->data + block->used, path, path_size);
+    block->used += path_size;
 
     return F5AR_OK;
 }
 
+/* Bytes of a file read whole while it was hashed, the decoding takes them instead of reading the file again */
+struct file_bytes {
+    unsigned char* data;
+    size_t size;
+};
+
+static const struct file_bytes no_bytes = {NULL, 0};
+
+/* Call it holding the context lock if other threads could fill the archive */
+static void release_bytes(struct f5archive_ctx* ctx, struct file_bytes bytes) {
+    free(bytes.data), ctx->cached -= bytes.size;
+}
+
+/* Only the path is kept, the file is opened again whenever the container is hashed, decoded or written */
+static void set_source(struct f5archive_ctx* ctx, container_t* container, struct file_bytes bytes) {
+    container->src.type = ctx->mapped ? MMAP_SRC : FILE_SRC;
+    container->src.fs.bytes = bytes.data,
+    container->src.fs.bytes_size = bytes.size;
+}
+
 int f5ar_add_file(f5archive *archive, const char *path) {
-    FILE* src = fopen(path, "rb");
-    if (!src)
+    if (!archive->ctx)
+        return F5AR_NOT_INITIALIZED;
+
+    if (access(path, R_OK))
         return F5AR_FILEIO_ERR;
 
-    struct linked_container* new = append_new(archive);
-    if (!new) {
-        fclose(src);
+    container_t* new = append_new(archive);
+    if (!new)
         return F5AR_MALLOC_ERR;
+
+    set_source(archive->ctx, new, no_bytes);
+
+    const int err = copy_fs_path(archive->ctx, new, path);
+    if (err) {
+        free_tail(archive);
+        return err;
     }
 
-    new->container.src.type = FILE_SRC;
-    new->container.src.fs.stream = src;
+    archive->ctx->filled++;
+    return F5AR_OK;
+}
 
-    const int err = copy_fs_path(archive, new, path);
-    if (!err)
-        archive->ctx->filled++;
-    return err;
+int f5ar_add_file_analyzed(f5archive *archive, const char *path, f5archive_capacity capacity) {
+    const int err = f5ar_add_file(archive, path);
+    if (err)
+        return err;
+
+    container_t* added = &archive->ctx->containers[archive->ctx->size - 1];
+    added->capacity = capacity,
+    added->analyzed = true;
+
+    return F5AR_OK;
 }
 
 int f5ar_add_mem(f5archive *archive, void *ptr, size_t* size) {
-    struct linked_container* new = append_new(archive);
+    container_t* new = append_new(archive);
     if (!new)
         return F5AR_MALLOC_ERR;
 
-    new->container.src.type = MEM_SRC;
-    new->container.src.mem.ptr = ptr;
-    new->container.src.mem.size = size;
+    new->src.type = MEM_SRC;
+    new->src.mem.ptr = ptr;
+    new->src.mem.size = size;
 
     archive->ctx->filled++;
     return F5AR_OK;
@@ -122,16 +335,25 @@ static int f5archive_clear_ctx(struct f5archive_ctx* ctx) {
     if (!ctx)
         return F5AR_NOT_INITIALIZED;
 
-    struct linked_container *el = ctx->head, *tmp;
-    while (el) {
-        if (el->container.src.type == FILE_SRC) {
-            fclose(el->container.src.fs.stream);
-            free((el->container.src.fs.path));
-        }
+    for (uint32_t id = 0; id < ctx->size; id++) {
+        if (ctx->containers[id].is_active)
+            container_close_discard(&ctx->containers[id]);
 
-        tmp = el, el = el->next, free(tmp);
+        if (ctx->containers[id].src.type != MEM_SRC)
+            free(ctx->containers[id].src.fs.bytes);
     }
 
+    free(ctx->containers);
+    ctx->containers = NULL, ctx->reserved = 0;
+
+    while (ctx->paths) {
+        struct path_block* prev = ctx->paths->prev;
+        free(ctx->paths), ctx->paths = prev;
+    }
+
+    free(ctx->waiting), free(ctx->twins);
+    ctx->waiting = NULL, ctx->waiting_size = 0, ctx->twins = NULL;
+
     return F5AR_OK;
 }
 
@@ -140,22 +362,53 @@ void f5ar_destroy(f5archive *archive) {
         return;
 
     f5archive_clear_ctx(archive->ctx),
+    parallel_pool_free(&archive->ctx->pool),
+    container_scratch_release(),
+    pthread_mutex_destroy(&archive->ctx->lock),
+    free(archive->ctx->errs),
     free(archive->ctx);
 }
 
+/* Segmented orders keep bit offset and length of the segment after every hash */
+#define SEGMENT_SIZE (2 * sizeof(uint64_t))
+#define order_entry_size(meta) (MD5_SIZE + ((meta).layout == F5AR_LAYOUT_SEGMENTED ? SEGMENT_SIZE : 0))
+
+int f5ar_get_info(f5archive *archive, size_t id, f5ar_info *info) {
+    if (!archive->ctx)
+        return F5AR_NOT_INITIALIZED;
+
+    if (id >= archive->ctx->size)
+        return F5AR_WRONG_ARGS;
+
+    struct f5archive_ctx* ctx = archive->ctx;
+    const container_t* container = &ctx->containers[id];
+    info->path = (container->src.type != MEM_SRC) ? container->src.fs.path : NULL;
+    memcpy(info->hash, container->hash, MD5_SIZE);
+
+    info->capacity = container->capacity,
+    info->analyzed = container->analyzed,
+    info->used = id < ctx->used;
+
+    return F5AR_OK;
+}
+
 static inline void export_to(f5archive* archive, char* dest, size_t size) {
-    struct linked_container* el = archive->ctx->head;
-    while (size)
-        memcpy(dest, el->container.hash, MD5_SIZE),
-        dest += MD5_SIZE, size--,
-        el = el->next;
+    const bool segmented = archive->meta.layout == F5AR_LAYOUT_SEGMENTED;
+
+    for (size_t id = 0; id < size; id++) {
+        const container_t* container = &archive->ctx->containers[id];
+
+        memcpy(dest, container->hash, MD5_SIZE), dest += MD5_SIZE;
+        if (segmented)
+            memcpy(dest, &container->segment, SEGMENT_SIZE), dest += SEGMENT_SIZE;
+    }
 }
 
 f5ar_blob* f5ar_export_order(f5archive* archive) {
     if (!archive->ctx)
         return NULL;
 
-    const size_t mem_size = archive->ctx->size * MD5_SIZE;
+    const size_t mem_size = archive->ctx->size * order_entry_size(archive->meta);
     f5ar_blob* order = malloc(sizeof(f5ar_blob) + mem_size);
 
     if (!order)
@@ -171,7 +424,7 @@ f5ar_blob* f5ar_export_order_used(f5archive* archive) {
     if (!archive->ctx)
         return NULL;
 
-    const size_t mem_size = archive->ctx->used * MD5_SIZE;
+    const size_t mem_size = archive->ctx->used * order_entry_size(archive->meta);
     f5ar_blob* order = malloc(sizeof(f5ar_blob) + mem_size);
 
     if (!order)
@@ -184,44 +437,119 @@ f5ar_blob* f5ar_export_order_used(f5archive* archive) {
 }
 
 static inline int import_to(f5archive* archive, char* src, size_t size) {
-    while (size) {
-        append_new(archive);
+    const bool segmented = archive->meta.layout == F5AR_LAYOUT_SEGMENTED;
+    const uint64_t msg_bits = archive->meta.msg_size * 8;
 
-        if (archive->ctx->tail)
-            memcpy(archive->ctx->tail->container.hash, src, MD5_SIZE);
-        else
+    /* End of the last segment imported, the packing lays them out one after another */
+    uint64_t end = 0;
+
+    while (size) {
+        container_t* container = append_new(archive);
+        if (!container)
             return F5AR_MALLOC_ERR;
 
-        size -= MD5_SIZE, src += MD5_SIZE;
+        memcpy(container->hash, src, MD5_SIZE), src += MD5_SIZE;
+
+        if (segmented) {
+            memcpy(&container->segment, src, SEGMENT_SIZE), src += SEGMENT_SIZE;
+
+            /* Segments are unpacked in parallel, so they should be whole bytes not shared with others */
+            if (container->segment.offset % 8 || container->segment.bits % 8 || container->segment.offset > msg_bits ||
+                container->segment.bits > msg_bits - container->segment.offset)
+                return F5AR_WRONG_ARGS;
+
+            if (container->segment.bits && container->segment.offset < end)
+                return F5AR_WRONG_ARGS;
+            if (container->segment.bits)
+                end = container->segment.offset + container->segment.bits;
+        }
+
+        size -= order_entry_size(archive->meta);
+    }
+
+    return F5AR_OK;
+}
+
+static struct waiting_slot* find_waiting(struct f5archive_ctx* ctx, const char* hash) {
+    /* MD5 is uniform enough to be its own hash */
+    uint64_t start;
+    memcpy(&start, hash, sizeof(uint64_t));
+
+    size_t slot = (size_t) start & (ctx->waiting_size - 1);
+    while (ctx->waiting[slot].first != NO_CONTAINER &&
+           memcmp(ctx->containers[ctx->waiting[slot].first].hash, hash, MD5_SIZE))
+        slot = (slot + 1) & (ctx->waiting_size - 1);
+    return &ctx->waiting[slot];
+}
+
+static int index_waiting(struct f5archive_ctx* ctx) {
+    ctx->waiting_size = 16;
+    while (ctx->waiting_size < 2 * (size_t) ctx->size)
+        ctx->waiting_size *= 2;
+
+    ctx->waiting = malloc(sizeof(struct waiting_slot) * ctx->waiting_size);
+    ctx->twins = malloc(sizeof(uint32_t) * (ctx->size ? ctx->size : 1));
+    if (!ctx->waiting || !ctx->twins)
+        return F5AR_MALLOC_ERR;
+
+    for (size_t slot = 0; slot < ctx->waiting_size; slot++)
+        ctx->waiting[slot].first = ctx->waiting[slot].next = NO_CONTAINER;
+
+    /* Going backwards leaves the first imported twin at the head of the chain */
+    for (uint32_t id = ctx->size; id--;) {
+        struct waiting_slot* slot = find_waiting(ctx, ctx->containers[id].hash);
+        ctx->twins[id] = slot->next;
+        slot->first = slot->next = id;
     }
 
     return F5AR_OK;
 }
 
+/* First imported container with the hash that has no source yet */
+static uint32_t take_waiting(struct f5archive_ctx* ctx, const char* hash) {
+    if (!ctx->waiting)
+        return NO_CONTAINER;
+
+    struct waiting_slot* slot = find_waiting(ctx, hash);
+    const uint32_t id = slot->next;
+    if (id != NO_CONTAINER)
+        slot->next = ctx->twins[id];
+    return id;
+}
+
 int f5ar_import_order(f5archive *archive, f5ar_blob *order) {
     if (!archive->ctx)
         return F5AR_NOT_INITIALIZED;
 
+    if (order->size % order_entry_size(archive->meta))
+        return F5AR_WRONG_ARGS;
+
     f5archive_clear_ctx(archive->ctx);
 
-    return import_to(archive, order->body, order->size);
+    archive->ctx->size = archive->ctx->filled = archive->ctx->used = 0;
+
+    const int err = import_to(archive, order->body, order->size);
+    return err ? err : index_waiting(archive->ctx);
 }
 
 #define abs(x) (x >= 0 ? x : -x)
-static f5archive_capacity capacity(container_t *container, struct f5archive_ctx* ctx) {
+/* Counts the capacity of a container, leaves it zero if the container could not be decoded */
+static int capacity(container_t *container, struct f5archive_ctx* ctx, struct jpeg_error_mgr* jerr) {
     f5archive_capacity capacity = {};
+    container->capacity = capacity;
 
-    int err = container_open(container, &ctx->err);
+    const bool was_active = container->is_active;
+    int err = container_open(container, jerr, false);
     if (err)
-        return capacity;
+        return err;
 
-    for (JDIMENSION row_id = 0; row_id < container->jpeg.dstruct.comp_info[0].height_in_blocks; row_id++) {
-        JBLOCKROW row = container->jpeg.dstruct.mem->access_virt_barray(
-                (j_common_ptr) &container->jpeg.dstruct, container->jpeg.dct_arrays[0],
+    for (JDIMENSION row_id = 0; row_id < container->jpeg->dstruct.comp_info[0].height_in_blocks; row_id++) {
+        JBLOCKROW row = container->jpeg->dstruct.mem->access_virt_barray(
+                (j_common_ptr) &container->jpeg->dstruct, container->jpeg->dct_arrays[0],
                 row_id, (JDIMENSION) 1, FALSE
         )[0];
 
-        for (size_t block_id = 0; block_id < container->jpeg.dstruct.comp_info[0].width_in_blocks; block_id++) {
+        for (size_t block_id = 0; block_id < container->jpeg->dstruct.comp_info[0].width_in_blocks; block_id++) {
             for (unsigned i = 0; i < DCTSIZE2; i++) {
                 const JCOEF c = abs(row[block_id][i]);
 
@@ -231,68 +559,229 @@ static f5archive_capacity capacity(container_t *container, struct f5archive_ctx*
         }
     }
 
-    container_close_discard(container);
-    return capacity;
+    container->capacity = capacity;
+    if (was_active)
+        return F5AR_OK;
+
+    /* Keep decoded coefficients for the packing while they fit */
+    const size_t footprint = container_footprint(container);
+
+    pthread_mutex_lock(&ctx->lock);
+    const bool keep = ctx->cached + footprint <= ctx->cache_limit;
+    ctx->cached += keep ? footprint : 0;
+    pthread_mutex_unlock(&ctx->lock);
+
+    if (!keep)
+        container_close_discard(container);
+    return F5AR_OK;
 }
 
-/* Will be called only once */
-int f5ar_analyze(f5archive *archive) {
-    if (!archive->ctx)
-        return F5AR_NOT_INITIALIZED;
+struct analyze_job {
+    struct f5archive_ctx* ctx;
+    struct prefetch* pf;
+
+    /* Id of the first container of the range being analyzed */
+    size_t first;
+};
+
+static void analyze_task(void *arg, unsigned worker, size_t id) {
+    struct analyze_job* job = arg;
+    container_t* container = &job->ctx->containers[id += job->first];
+
+    const bool prefetched = take_prefetched(job->pf, container, id);
+    if (!container->analyzed) {
+        advise_containers(job->ctx, id);
+
+        /* A container failed to open is analyzed again next time rather than remembered as empty */
+        container->analyzed = !capacity(container, job->ctx, &job->ctx->errs[worker]);
+    }
+
+    /* Coefficients kept for the packing do not need the file bytes */
+    if (prefetched)
+        container_release_bytes(container);
+}
+
+/* Every analysis counts capacities and kept containers anew, files are read ahead through the whole order */
+static void analyze_begin(f5archive *archive, struct analyze_job* job, struct prefetch* pf) {
+    struct f5archive_ctx* ctx = archive->ctx;
 
     archive->capacity.full = 0,
     archive->capacity.shrinkable = 0;
 
-    struct linked_container* el = archive->ctx->head;
-    while (el) {
-        const f5archive_capacity local = capacity(&el->container, archive->ctx);
+    ctx->cached = 0, ctx->advised = 0, ctx->bounded = false;
+    for (size_t i = 0; i < ctx->size; i++)
+        ctx->cached += ctx->containers[i].is_active ? container_footprint(&ctx->containers[i]) : 0;
 
-        archive->capacity.full += local.full;
-        archive->capacity.shrinkable += local.shrinkable;
+    job->ctx = ctx, job->pf = NULL, job->first = 0;
+    if (ctx->read_ahead && !ctx->mapped && !prefetch_start(pf, ctx->size, unanalyzed_path, ctx, ctx->read_ahead))
+        job->pf = pf;
+}
 
-        el = el->next;
-    }
+/* Ranges go one after another, every container of the range is added to the totals */
+static int analyze_range(f5archive *archive, struct analyze_job* job, size_t first, size_t count) {
+    job->first = first;
+    const int err = parallel_for(&archive->ctx->pool, count, analyze_task, job);
+    if (err)
+        return err;
+
+    /* Reduce in the order, so totals do not depend on the scheduling */
+    for (size_t i = first; i < first + count; i++)
+        archive->capacity.full += archive->ctx->containers[i].capacity.full,
+        archive->capacity.shrinkable += archive->ctx->containers[i].capacity.shrinkable;
 
     return F5AR_OK;
 }
 
-int f5ar_fill_file(f5archive *archive, const char *path) {
+/* Containers with already known capacity are not decoded again */
+int f5ar_analyze(f5archive *archive) {
     if (!archive->ctx)
         return F5AR_NOT_INITIALIZED;
 
+    struct prefetch pf;
+    struct analyze_job job;
+    analyze_begin(archive, &job, &pf);
+
+    const int err = analyze_range(archive, &job, 0, archive->ctx->size);
+    if (job.pf)
+        prefetch_stop(job.pf);
+    return err;
+}
+
+/* Reads the file whole if its size fits into what is left of the cache limit */
+static struct file_bytes read_within_limit(struct f5archive_ctx* ctx, FILE* src) {
+    struct file_bytes bytes = no_bytes;
+    if (!ctx->cache_limit || fseek(src, 0, SEEK_END))
+        return bytes;
+
+    const long end = ftell(src);
+    fseek(src, 0, SEEK_SET);
+    if (end <= 0)
+        return bytes;
+
+    pthread_mutex_lock(&ctx->lock);
+    const bool fits = ctx->cached + (size_t) end <= ctx->cache_limit;
+    ctx->cached += fits ? (size_t) end : 0;
+    pthread_mutex_unlock(&ctx->lock);
+
+    if (!fits)
+        return bytes;
+
+    bytes.data = malloc((size_t) end);
+    if (bytes.data && fread(bytes.data, 1, (size_t) end, src) == (size_t) end) {
+        bytes.size = (size_t) end;
+        return bytes;
+    }
+
+    free(bytes.data), bytes.data = NULL;
+    fseek(src, 0, SEEK_SET);
+
+    pthread_mutex_lock(&ctx->lock);
+    ctx->cached -= (size_t) end;
+    pthread_mutex_unlock(&ctx->lock);
+    return bytes;
+}
+
+/* File is closed right after reading, the bytes are kept if they fit into the cache limit and are gone on failure
+* Files read whole are left for the caller to hash, the rest are hashed on their way */
+static int read_file(f5archive *archive, const char* path, char* hash, struct file_bytes* bytes) {
+    *bytes = no_bytes;
+    if (archive->ctx->mapped) {
+        unsigned char* data;
+        size_t size;
+        if (container_map(path, &data, &size))
+            return F5AR_FILEIO_ERR;
+
+        container_hash_bytes(data, size, hash, archive->meta.hash);
+        container_unmap(data, size);
+        return F5AR_OK;
+    }
+
     FILE* src = fopen(path, "rb");
     if (!src)
         return F5AR_FILEIO_ERR;
 
+    int err = F5AR_OK;
+    *bytes = read_within_limit(archive->ctx, src);
+    if (!bytes->data && container_hash_stream(src, hash, archive->meta.hash))
+        err = F5AR_FILEIO_ERR;
+
+    fclose(src);
+    return err;
+}
+
+static int hash_file(f5archive *archive, const char* path, char* hash, struct file_bytes* bytes) {
+    const int err = read_file(archive, path, hash, bytes);
+    if (!err && bytes->data)
+        container_hash_bytes(bytes->data, bytes->size, hash, archive->meta.hash);
+    return err;
+}
+
+/* Puts the file into the first slot with the same hash, call it holding the context lock
+* Files hashed by the caller are checked during the decoding */
+static int fill_path(f5archive *archive, const char *path, const char *hash,
+                     struct file_bytes bytes, bool trusted) {
+    const uint32_t id = take_waiting(archive->ctx, hash);
+    int err = (id != NO_CONTAINER) ? F5AR_OK : F5AR_NOT_FOUND;
+
+    container_t* container = err ? NULL : &archive->ctx->containers[id];
+    if (container && (err = copy_fs_path(archive->ctx, container, path)))
+        find_waiting(archive->ctx, hash)->next = id;
+
+    if (err) {
+        release_bytes(archive->ctx, bytes);
+        return err;
+    }
+
+    set_source(archive->ctx, container, bytes);
+    container->src.fs.verify = trusted,
+    container->src.fs.verify_with = archive->meta.hash;
+
+    archive->ctx->filled++;
+    return (archive->ctx->filled == archive->ctx->size) ? F5AR_OK_COMPLETE : F5AR_OK;
+}
+
+int f5ar_fill_file(f5archive *archive, const char *path) {
+    if (!archive->ctx)
+        return F5AR_NOT_INITIALIZED;
+
     char hash[MD5_SIZE];
-    if (md5_file(src, hash)) {
-        fclose(src);
+    struct file_bytes bytes;
+    if (hash_file(archive, path, hash, &bytes))
         return F5AR_FILEIO_ERR;
-    }
 
-    struct linked_container *el = archive->ctx->head;
-    while (el) {
-        if (!memcmp(el->container.hash, hash, MD5_SIZE)) {
-            fseek(src, 0, SEEK_SET);
+    pthread_mutex_lock(&archive->ctx->lock);
+    const int err = fill_path(archive, path, hash, bytes, false);
+    pthread_mutex_unlock(&archive->ctx->lock);
 
-            el->container.src.type = FILE_SRC;
-            el->container.src.fs.stream = src;
+    return err;
+}
 
-            const int err = copy_fs_path(archive, el, path);
-            if (err) {
-                fclose(src);
-                return err;
-            }
+int f5ar_fill_file_hashed(f5archive *archive, const char *path, const char *hash) {
+    if (!archive->ctx)
+        return F5AR_NOT_INITIALIZED;
 
-            archive->ctx->filled++;
-            return (archive->ctx->filled == archive->ctx->size) ? F5AR_OK_COMPLETE : F5AR_OK;
-        }
+    if (access(path, R_OK))
+        return F5AR_FILEIO_ERR;
 
-        el = el->next;
-    }
+    pthread_mutex_lock(&archive->ctx->lock);
+    const int err = fill_path(archive, path, hash, no_bytes, true);
+    pthread_mutex_unlock(&archive->ctx->lock);
 
-    fclose(src);
-    return F5AR_NOT_FOUND;
+    return err;
+}
+
+static int fill_buffer(f5archive *archive, void *ptr, size_t* size, const char *hash) {
+    const uint32_t id = take_waiting(archive->ctx, hash);
+    if (id == NO_CONTAINER)
+        return F5AR_NOT_FOUND;
+
+    container_t* container = &archive->ctx->containers[id];
+    container->src.type = MEM_SRC;
+    container->src.mem.ptr = ptr;
+    container->src.mem.size = size;
+
+    archive->ctx->filled++;
+    return (archive->ctx->filled == archive->ctx->size) ? F5AR_OK_COMPLETE : F5AR_OK;
 }
 
 int f5ar_fill_mem(f5archive *archive, void *ptr, size_t* size) {
@@ -302,65 +791,696 @@ int f5ar_fill_mem(f5archive *archive, void *ptr, size_t* size) {
     char hash[MD5_SIZE];
     md5_buffer(ptr, *size, hash);
 
-    struct linked_container *el = archive->ctx->head;
-    while (el) {
-        if (!memcmp(el->container.hash, hash, MD5_SIZE)) {
-            el->container.src.type = MEM_SRC;
-            el->container.src.mem.ptr = ptr;
-            el->container.src.mem.size = size;
+    return fill_buffer(archive, ptr, size, hash);
+}
 
-            archive->ctx->filled++;
-            return (archive->ctx->filled == archive->ctx->size) ? F5AR_OK_COMPLETE : F5AR_OK;
-        }
+static const char unknown_hash[MD5_SIZE];
 
-        el = el->next;
-    }
+/* Files of a task are read one after another and hashed together by the multi-lane MD5 */
+#define FILL_LANES 16
+
+struct fill_job {
+    f5archive* archive;
+    const char *const *paths;
+    char (*hashes)[MD5_SIZE];
+    int err;
 
-    return F5AR_NOT_FOUND;
+    struct prefetch* pf;
+    size_t advised;
+    size_t count;
+    size_t per_task;
+};
+
+static inline bool fill_trusted(const struct fill_job* job, size_t id) {
+    return job->hashes && memcmp(job->hashes[id], unknown_hash, MD5_SIZE);
 }
 
-static unsigned f5em(JCOEF **a, size_t n) {
-    unsigned hash = 0;
-    for (size_t i = 0; i < n;)
-        if (*(a[i++]) & 1)
-            hash ^= i;
-    return hash;
+/* Only the files with unknown hashes are read */
+static const char* unhashed_path(void *arg, size_t id) {
+    const struct fill_job* job = arg;
+    return fill_trusted(job, id) ? NULL : job->paths[id];
 }
 
-static int catch_up(f5archive* archive, struct linked_container** glob, struct linked_container* local) {
-    struct linked_container* el = *glob;
-    int err = F5AR_OK;
+/* Hashed prefetched file is kept for the decoding if it fits into the cache limit */
+static void keep_prefetched(struct f5archive_ctx* ctx, struct file_bytes* bytes) {
+    pthread_mutex_lock(&ctx->lock);
+    const bool fits = ctx->cache_limit && ctx->cached + bytes->size <= ctx->cache_limit;
+    ctx->cached += fits ? bytes->size : 0;
+    pthread_mutex_unlock(&ctx->lock);
 
-    while (el != local) {
-        err = container_close_keep(&el->container, &archive->ctx->err);
-        el = el->next, archive->ctx->used++;
-    }
+    if (!fits)
+        free(bytes->data), *bytes = no_bytes;
+}
 
-    *glob = el;
-    return err;
+static inline bool fill_complete(struct f5archive_ctx* ctx) {
+    pthread_mutex_lock(&ctx->lock);
+    const bool complete = ctx->filled == ctx->size;
+    pthread_mutex_unlock(&ctx->lock);
+    return complete;
 }
 
-static unsigned calc_k(f5archive_capacity arch_capacity, size_t size) {
-    unsigned k = 1, capacity;
+/* Files are hashed concurrently, only the slot lookup is serialized
+* Bytes prefetched or read whole are hashed in one batch, files past the cache limit are hashed as streams */
+static void fill_task(void *arg, unsigned worker, size_t task) {
+    struct fill_job* job = arg;
+    struct f5archive_ctx* ctx = job->archive->ctx;
 
-    while (k < 24) {
-        capacity = arch_capacity.full + arch_capacity.shrinkable / k * 2;
+    const size_t first = task * job->per_task;
+    const size_t count = (first + job->per_task < job->count) ? job->per_task : job->count - first;
 
-        double kn_rate = ((double) k) / ((1 << k) - 1);
-        double embed_rate = ((double) (size * 8)) / capacity;
+    /* Every file is taken from the prefetch, so it keeps moving on */
+    struct file_bytes bytes[FILL_LANES];
+    for (size_t i = 0; i < count; i++) {
+        advise_ahead(ctx, &job->advised, first + i, job->count, unhashed_path, job);
 
-        if (embed_rate >= kn_rate)
-            return k-1;
-        else
-            k++;
+        bytes[i] = no_bytes;
+        if (job->pf)
+            bytes[i].data = prefetch_take(job->pf, first + i, &bytes[i].size);
     }
 
-    return k;
-}
+    /* Remaining tasks are drained without touching their files once the order is complete */
+    if (fill_complete(ctx)) {
+        for (size_t i = 0; i < count; i++)
+            free(bytes[i].data);
+        return;
+    }
 
-int f5ar_pack(f5archive *archive, const char *data, size_t size) {
-    if (!archive->ctx || archive->ctx->filled != archive->ctx->size)
-        return F5AR_NOT_COMPLETE;
+    char hashes[FILL_LANES][MD5_SIZE];
+    bool trusted[FILL_LANES], prefetched[FILL_LANES], skipped[FILL_LANES];
+
+    const unsigned char* srcs[FILL_LANES];
+    size_t sizes[FILL_LANES], lanes[FILL_LANES], pending = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        const size_t id = first + i;
+        trusted[i] = fill_trusted(job, id), prefetched[i] = bytes[i].data != NULL;
+
+        if (trusted[i]) {
+            skipped[i] = access(job->paths[id], R_OK) != 0;
+            memcpy(hashes[i], job->hashes[id], MD5_SIZE);
+        } else
+            skipped[i] = !prefetched[i] && read_file(job->archive, job->paths[id], hashes[i], &bytes[i]);
+
+        if (!trusted[i] && !skipped[i] && bytes[i].data)
+            srcs[pending] = bytes[i].data, sizes[pending] = bytes[i].size, lanes[pending++] = i;
+    }
+
+    char digests[FILL_LANES][MD5_SIZE];
+    container_hash_batch(srcs, sizes, pending, digests, job->archive->meta.hash);
+    for (size_t l = 0; l < pending; l++) {
+        memcpy(hashes[lanes[l]], digests[l], MD5_SIZE);
+        if (prefetched[lanes[l]])
+            keep_prefetched(ctx, &bytes[lanes[l]]);
+    }
+
+    /* Hashes are looked at by the advising holding the lock */
+    pthread_mutex_lock(&ctx->lock);
+    for (size_t i = 0; i < count; i++) {
+        if (skipped[i])
+            continue;
+
+        const size_t id = first + i;
+        if (!trusted[i] && job->hashes)
+            memcpy(job->hashes[id], hashes[i], MD5_SIZE);
+
+        const int err = fill_path(job->archive, job->paths[id], hashes[i], bytes[i], trusted[i]);
+        if (err < 0 && !job->err)
+            job->err = err;
+    }
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+int f5ar_fill_files(f5archive *archive, const char *const *paths, char (*hashes)[MD5_SIZE], size_t count) {
+    if (!archive->ctx)
+        return F5AR_NOT_INITIALIZED;
+
+    /* Tasks are made no larger than needed to give every thread one */
+    size_t per_task = count / archive->ctx->threads;
+    per_task = per_task < 1 ? 1 : per_task > FILL_LANES ? FILL_LANES : per_task;
+
+    struct prefetch pf;
+    struct fill_job job = {archive, paths, hashes, F5AR_OK, NULL, 0, count, per_task};
+    if (archive->ctx->read_ahead && !archive->ctx->mapped &&
+        !prefetch_start(&pf, count, unhashed_path, &job, archive->ctx->read_ahead))
+        job.pf = &pf;
+
+    const int err = parallel_for(&archive->ctx->pool, (count + per_task - 1) / per_task, fill_task, &job);
+    if (job.pf)
+        prefetch_stop(job.pf);
+    if (err || job.err)
+        return err ? err : job.err;
+
+    return (archive->ctx->filled == archive->ctx->size) ? F5AR_OK_COMPLETE : F5AR_OK;
+}
+
+/* Buffers are hashed together by the multi-lane MD5 */
+int f5ar_fill_mems(f5archive *archive, void **ptrs, size_t **sizes, size_t count) {
+    if (!archive->ctx)
+        return F5AR_NOT_INITIALIZED;
+
+    if (!count)
+        return (archive->ctx->filled == archive->ctx->size) ? F5AR_OK_COMPLETE : F5AR_OK;
+
+    size_t* plain = malloc(sizeof(size_t) * count);
+    char (*hashes)[MD5_SIZE] = malloc(MD5_SIZE * count);
+    if (!plain || !hashes) {
+        free(plain), free(hashes);
+        return F5AR_MALLOC_ERR;
+    }
+
+    for (size_t i = 0; i < count; i++)
+        plain[i] = *sizes[i];
+    md5_buffers_batch((const void* const*) ptrs, plain, count, hashes);
+
+    for (size_t i = 0; i < count && archive->ctx->filled != archive->ctx->size; i++)
+        fill_buffer(archive, ptrs[i], sizes[i], hashes[i]);
+
+    free(plain), free(hashes);
+    return (archive->ctx->filled == archive->ctx->size) ? F5AR_OK_COMPLETE : F5AR_OK;
+}
+
+/* Containers the packing could go through */
+static inline uint32_t pack_size(const struct f5archive_ctx* ctx) {
+    return ctx->bounded ? ctx->needed : ctx->size;
+}
+
+/* Pipelined packing of the stream layout: while the calling thread embeds, helpers decode containers
+* ahead of it and encode, hash and write finished ones behind it. Both queues are bounded by the window */
+enum PIPE_STATE { PIPE_IDLE, PIPE_BUSY, PIPE_READY, PIPE_FAILED };
+
+struct pack_pipe {
+    struct f5archive_ctx* ctx;
+    uint8_t hash;
+
+    uint8_t* state;
+    uint32_t window;
+
+    /* Containers below embedded are done with, the one at embedded is being embedded */
+    uint32_t decode_next;
+    uint32_t embedded;
+    uint32_t write_next;
+    uint32_t written;
+
+    bool stop;
+    int err;
+
+    /* Files read ahead of the decoding, every container takes its own before being opened */
+    struct prefetch* pf;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+struct pack_helper {
+    struct pack_pipe* pipe;
+    struct jpeg_error_mgr* jerr;
+};
+
+static void* pack_helper_run(void* arg) {
+    struct pack_helper* helper = arg;
+    struct pack_pipe* pipe = helper->pipe;
+    container_t* containers = pipe->ctx->containers;
+
+    pthread_mutex_lock(&pipe->lock);
+    while (true) {
+        /* Writing comes first, it is what lets the embedding go on */
+        if (pipe->write_next < pipe->embedded) {
+            const uint32_t id = pipe->write_next++;
+            pthread_mutex_unlock(&pipe->lock);
+
+            const int err = container_close_keep(&containers[id], helper->jerr, pipe->hash);
+
+            pthread_mutex_lock(&pipe->lock);
+            pipe->err = pipe->err ? pipe->err : err;
+            pipe->written++;
+            pthread_cond_broadcast(&pipe->cond);
+        } else if (!pipe->stop && !pipe->err && pipe->decode_next < pack_size(pipe->ctx) &&
+                   pipe->decode_next <= pipe->embedded + pipe->window) {
+            const uint32_t id = pipe->decode_next++;
+            if (pipe->state[id] != PIPE_IDLE)
+                continue;
+
+            pipe->state[id] = PIPE_BUSY;
+            pthread_mutex_unlock(&pipe->lock);
+
+            advise_containers(pipe->ctx, id);
+            take_prefetched(pipe->pf, &containers[id], id);
+            const int err = container_open(&containers[id], helper->jerr, true);
+
+            pthread_mutex_lock(&pipe->lock);
+            /* Containers ahead could be never reached, so their errors are left for the embedding to find */
+            pipe->state[id] = err ? PIPE_FAILED : PIPE_READY;
+            pthread_cond_broadcast(&pipe->cond);
+        } else if (pipe->stop)
+            break;
+        else
+            pthread_cond_wait(&pipe->cond, &pipe->lock);
+    }
+    pthread_mutex_unlock(&pipe->lock);
+
+    return NULL;
+}
+
+/* Container to embed into next, decoded by the embedding thread itself if no helper got to it
+* Failed ones are tried again to get the error */
+static int pipe_acquire(struct pack_pipe* pipe, uint32_t id) {
+    int err = F5AR_OK;
+
+    pthread_mutex_lock(&pipe->lock);
+    while (pipe->state[id] == PIPE_BUSY)
+        pthread_cond_wait(&pipe->cond, &pipe->lock);
+
+    if (pipe->state[id] != PIPE_READY) {
+        pipe->state[id] = PIPE_BUSY;
+        pthread_mutex_unlock(&pipe->lock);
+
+        advise_containers(pipe->ctx, id);
+        take_prefetched(pipe->pf, &pipe->ctx->containers[id], id);
+        err = container_open(&pipe->ctx->containers[id], &pipe->ctx->err, true);
+
+        pthread_mutex_lock(&pipe->lock);
+        pipe->state[id] = err ? PIPE_FAILED : PIPE_READY;
+        pthread_cond_broadcast(&pipe->cond);
+    }
+    pthread_mutex_unlock(&pipe->lock);
+
+    return err;
+}
+
+/* Hands containers before id to the writers, waiting while too many of them are not written yet
+* Returns the first write error */
+static int pipe_release(struct pack_pipe* pipe, uint32_t id) {
+    pthread_mutex_lock(&pipe->lock);
+    if (id > pipe->embedded) {
+        pipe->embedded = id;
+        pthread_cond_broadcast(&pipe->cond);
+    }
+
+    while (pipe->embedded - pipe->written > pipe->window && !pipe->err)
+        pthread_cond_wait(&pipe->cond, &pipe->lock);
+
+    const int err = pipe->err;
+    pthread_mutex_unlock(&pipe->lock);
+    return err;
+}
+
+/* Drains the writers and stops the helpers, containers decoded ahead of the last used one are discarded */
+static int pipe_finish(struct pack_pipe* pipe, pthread_t* handles, unsigned started, uint32_t used) {
+    pipe_release(pipe, used);
+
+    pthread_mutex_lock(&pipe->lock);
+    pipe->stop = true;
+    pthread_cond_broadcast(&pipe->cond);
+    pthread_mutex_unlock(&pipe->lock);
+
+    for (unsigned i = 0; i < started; i++)
+        pthread_join(handles[i], NULL);
+
+    for (uint32_t id = used; id < pipe->decode_next; id++)
+        if (pipe->state[id] == PIPE_READY && pipe->ctx->containers[id].is_active)
+            container_close_discard(&pipe->ctx->containers[id]);
+
+    pipe->ctx->used = used;
+    return pipe->err;
+}
+
+/* Walks nonzero coefficients of the order, bounded cursor never leaves its container
+* Pipelined cursor takes next containers from the pipe */
+struct coeff_cursor {
+    struct f5archive_ctx* ctx;
+    uint32_t id;
+    bool bounded;
+
+    struct jpeg_error_mgr* jerr;
+    struct pack_pipe* pipe;
+};
+
+/* Embeds kword into the next group of n nonzero coefficients, retrying on every shrinkage
+* Syndrome of the group is kept up to date, so a retry only touches the shifted tail */
+static int embed_group(struct coeff_cursor* cur, JCOEF** a, size_t n, unsigned kword) {
+    size_t ai = 0;
+    unsigned hash = 0;
+    int err = F5AR_OK;
+
+    container_t* container = &cur->ctx->containers[cur->id];
+    while (true) {
+        while (ai < n && !err) {
+            if (!nz_exhausted(container)) {
+                JCOEF* coeff = nz_next(container);
+                if (*coeff != 0)
+                    a[ai++] = coeff, hash ^= (*coeff & 1) ? ai : 0;
+            } else if (cur->id + 1 < pack_size(cur->ctx) && !cur->bounded) {
+                container = &cur->ctx->containers[++cur->id];
+                if (!cur->pipe)
+                    advise_containers(cur->ctx, cur->id);
+                err = cur->pipe ? pipe_acquire(cur->pipe, cur->id) : container_open(container, cur->jerr, true);
+            } else
+                err = F5AR_FAILURE;
+        }
+
+        if (err)
+            return err;
+
+        unsigned s = hash ^ kword;
+        if (s == 0)
+            return F5AR_OK;
+
+        JCOEF val = *(a[s-1]);
+        val += (val > 0) ? -1 : 1;
+
+        if ((*a[s-1] = val) != 0)
+            return F5AR_OK;
+
+        /* Shrunk coefficient was odd, every odd one after it moves one position back */
+        hash ^= s;
+        for (; s < n; s++) {
+            a[s-1] = a[s];
+            hash ^= (*a[s] & 1) ? s ^ (s + 1) : 0;
+        }
+
+        ai = n-1;
+    }
+}
+
+static int catch_up(f5archive* archive, uint32_t* glob, uint32_t local) {
+    int err = F5AR_OK;
+
+    for (; *glob != local; (*glob)++, archive->ctx->used++)
+        err = container_close_keep(&archive->ctx->containers[*glob], &archive->ctx->err, archive->meta.hash);
+
+    return err;
+}
+
+static unsigned calc_k(f5archive_capacity arch_capacity, size_t size) {
+    unsigned k = 1, capacity;
+
+    while (k < 24) {
+        capacity = arch_capacity.full + arch_capacity.shrinkable / k * 2;
+
+        double kn_rate = ((double) k) / ((1 << k) - 1);
+        double embed_rate = ((double) (size * 8)) / capacity;
+
+        if (embed_rate >= kn_rate)
+            return k-1;
+        else
+            k++;
+    }
+
+    return k;
+}
+
+/* Bytes a container surely carries in its own segment. Every shrinkage eats one of
+* the shrinkable coefficients, so the full ones alone bound the number of groups */
+static size_t segment_capacity(f5archive_capacity capacity, unsigned k) {
+    const size_t n = ((size_t) 1 << k) - 1;
+    return capacity.full / n * k / 8;
+}
+
+/* Splits size bytes into byte-aligned segments, returns how many bytes fit */
+static size_t plan_segments(struct f5archive_ctx* ctx, size_t size, unsigned k, bool apply) {
+    size_t planned = 0;
+
+    for (uint32_t id = 0; id < pack_size(ctx); id++) {
+        container_t* container = &ctx->containers[id];
+
+        size_t local = segment_capacity(container->capacity, k);
+        local = (local < size - planned) ? local : size - planned;
+
+        if (apply)
+            container->segment.offset = (uint64_t) planned * 8,
+            container->segment.bits = (uint64_t) local * 8;
+        planned += local;
+    }
+
+    return planned;
+}
+
+int f5ar_carries(f5archive *archive, size_t size, unsigned k) {
+    if (!archive->ctx)
+        return F5AR_NOT_INITIALIZED;
+    if (k == 0 || k > 23)
+        return F5AR_WRONG_ARGS;
+
+    if (archive->meta.layout == F5AR_LAYOUT_SEGMENTED)
+        return plan_segments(archive->ctx, size, k, false) == size;
+
+    /* Shrinkage never touches the full coefficients, so they alone bound every group of the stream */
+    const uint64_t n = ((uint64_t) 1 << k) - 1;
+    const uint64_t groups = ((uint64_t) size * 8 + k - 1) / k;
+    return archive->capacity.full > groups * n;
+}
+
+/* Containers are analyzed a few rounds of workers at a time, as a small message is often carried by the first ones */
+int f5ar_analyze_for(f5archive *archive, size_t size, unsigned k_min, unsigned k_max) {
+    if (!archive->ctx)
+        return F5AR_NOT_INITIALIZED;
+    if (k_min == 0 || k_min > k_max || k_max > 23)
+        return F5AR_WRONG_ARGS;
+
+    struct f5archive_ctx* ctx = archive->ctx;
+
+    struct prefetch pf;
+    struct analyze_job job;
+    analyze_begin(archive, &job, &pf);
+
+    /* f5ar_carries() looks at the containers analyzed so far only */
+    ctx->bounded = true, ctx->needed = 0;
+
+    int err = F5AR_OK;
+    const size_t round = 2 * (size_t) ctx->threads;
+    while (!err && ctx->needed < ctx->size && f5ar_carries(archive, size, k_min) != 1) {
+        /* Containers analyzed before only add their capacities, so they do not count towards the round */
+        size_t count = 0, pending = 0;
+        while (ctx->needed + count < ctx->size && pending < round)
+            pending += ctx->containers[ctx->needed + count++].analyzed ? 0 : 1;
+
+        err = analyze_range(archive, &job, ctx->needed, count);
+        ctx->needed += (uint32_t) count;
+    }
+
+    if (job.pf)
+        prefetch_stop(job.pf);
+
+    /* Analysis stops as soon as k_min is carried, larger k are picked only if those containers carry them too */
+    for (unsigned k = k_max; !err && k >= k_min; k--) {
+        if (f5ar_carries(archive, size, k) == 1) {
+            archive->meta.k = (uint8_t) k;
+            return F5AR_OK;
+        }
+    }
+
+    ctx->bounded = false;
+    return err ? err : F5AR_FAILURE;
+}
+
+static unsigned calc_k_segmented(f5archive* archive, size_t size) {
+    unsigned k = 0;
+    while (k < 23 && plan_segments(archive->ctx, size, k + 1, false) == size)
+        k++;
+
+    return k;
+}
+
+/* Workers of a job report to the same place, the first error is kept */
+static void task_fail(struct f5archive_ctx* ctx, int* dest, int err) {
+    pthread_mutex_lock(&ctx->lock);
+    *dest = *dest ? *dest : err;
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+struct segment_job {
+    struct f5archive_ctx* ctx;
+
+    const char* data;
+    char* msg;
+    size_t size;
+    unsigned k;
+    uint8_t hash;
+
+    /* Group buffer of every worker */
+    void** a;
+    int err;
+};
+
+static void pack_segment_task(void *arg, unsigned worker, size_t id) {
+    struct segment_job* job = arg;
+    container_t* container = &job->ctx->containers[id];
+
+    advise_containers(job->ctx, id);
+    if (!container->segment.bits) {
+        if (container_hash(container, job->hash))
+            task_fail(job->ctx, &job->err, F5AR_IO_ERR);
+        return;
+    }
+
+    struct coeff_cursor cur = {job->ctx, (uint32_t) id, true, &job->ctx->errs[worker], NULL};
+    const size_t n = ((size_t) 1 << job->k) - 1;
+
+    struct bit_reader msg;
+    bit_reader_init(&msg, job->data, job->size, container->segment.offset,
+                    container->segment.offset + container->segment.bits);
+
+    int err = container_open(container, cur.jerr, true);
+    while (msg.left && !err)
+        err = embed_group(&cur, job->a[worker], n, bit_read(&msg, job->k));
+
+    /* Container that failed to open has nothing to close */
+    if (!err)
+        err = container_close_keep(container, cur.jerr, job->hash);
+    else if (container->is_active)
+        container_close_discard(container);
+
+    if (err)
+        task_fail(job->ctx, &job->err, err);
+}
+
+static int segment_job_init(struct segment_job* job, f5archive* archive, size_t elem_size) {
+    const size_t n = ((size_t) 1 << job->k) - 1;
+
+    job->a = calloc(sizeof(void*), archive->ctx->threads);
+    if (!job->a)
+        return F5AR_MALLOC_ERR;
+
+    for (unsigned t = 0; t < archive->ctx->threads; t++)
+        if (!(job->a[t] = malloc(elem_size * n)))
+            return F5AR_MALLOC_ERR;
+
+    return F5AR_OK;
+}
+
+static void segment_job_free(struct segment_job* job, unsigned threads) {
+    for (unsigned t = 0; job->a && t < threads; t++)
+        free(job->a[t]);
+    free(job->a);
+}
+
+/* Every container carries its own segment, so they are embedded independently */
+static int pack_segmented(f5archive *archive, const char *data, size_t size) {
+    if (archive->meta.k == 0)
+        archive->meta.k = calc_k_segmented(archive, size);
+
+    if (archive->meta.k == 0 || plan_segments(archive->ctx, size, archive->meta.k, true) != size)
+        return F5AR_FAILURE;
+
+    struct segment_job job = {archive->ctx, data, NULL, size, archive->meta.k, archive->meta.hash};
+    int err = segment_job_init(&job, archive, sizeof(JCOEF*));
+
+    /* Only the order prefix carrying the message is used */
+    size_t used = 0;
+    for (size_t i = 0; !err && i < pack_size(archive->ctx); i++)
+        used = archive->ctx->containers[i].segment.bits ? i + 1 : used;
+
+    if (!err)
+        err = parallel_for(&archive->ctx->pool, used, pack_segment_task, &job);
+    if (!err)
+        err = job.err;
+
+    segment_job_free(&job, archive->ctx->threads);
+    archive->ctx->used = err ? 0 : (uint32_t) used;
+
+    return err;
+}
+
+static int pack_serial(f5archive *archive, const char *data, size_t size, JCOEF** a, size_t n) {
+    uint32_t id = 0;
+    advise_containers(archive->ctx, id);
+    int err = container_open(&archive->ctx->containers[id], &archive->ctx->err, true);
+    if (err)
+        return err;
+
+    struct coeff_cursor cur = {archive->ctx, id, false, &archive->ctx->err, NULL};
+
+    struct bit_reader msg;
+    bit_reader_init(&msg, data, size, 0, (uint64_t) size * 8);
+
+    while (msg.left && !err) {
+        err = embed_group(&cur, a, n, bit_read(&msg, archive->meta.k));
+
+        const int kept = catch_up(archive, &id, cur.id);
+        err = err ? err : kept;
+    }
+
+    /* Current container is kept as well unless it failed to open */
+    if (!archive->ctx->containers[id].is_active)
+        return err;
+
+    archive->ctx->used++;
+
+    const int kept = container_close_keep(&archive->ctx->containers[id], &archive->ctx->err, archive->meta.hash);
+    return err ? err : kept;
+}
+
+static int pack_pipelined(f5archive *archive, const char *data, size_t size, JCOEF** a, size_t n) {
+    struct f5archive_ctx* ctx = archive->ctx;
+    const unsigned helpers = ctx->threads - 1;
+
+    struct pack_pipe pipe = {ctx, archive->meta.hash, calloc(ctx->size, 1), 2 * helpers};
+    pthread_t* handles = malloc(sizeof(pthread_t) * helpers);
+    struct pack_helper* workers = malloc(sizeof(struct pack_helper) * helpers);
+
+    int err = (pipe.state && handles && workers) ? F5AR_OK : F5AR_MALLOC_ERR;
+    if (!err && pthread_mutex_init(&pipe.lock, NULL))
+        err = F5AR_FAILURE;
+    if (!err && pthread_cond_init(&pipe.cond, NULL))
+        pthread_mutex_destroy(&pipe.lock), err = F5AR_FAILURE;
+
+    if (err) {
+        free(pipe.state), free(handles), free(workers);
+        return err;
+    }
+
+    struct prefetch pf;
+    if (ctx->read_ahead && !ctx->mapped && !prefetch_start(&pf, pack_size(ctx), undecoded_path, ctx, ctx->read_ahead))
+        pipe.pf = &pf;
+
+    unsigned started = 0;
+    for (; started < helpers; started++) {
+        workers[started].pipe = &pipe, workers[started].jerr = &ctx->errs[started + 1];
+        if (pthread_create(&handles[started], NULL, pack_helper_run, &workers[started]))
+            break;
+    }
+
+    /* No writers means nothing would ever drain the queue */
+    if (!started) {
+        if (pipe.pf)
+            prefetch_stop(pipe.pf);
+        pthread_cond_destroy(&pipe.cond), pthread_mutex_destroy(&pipe.lock);
+        free(pipe.state), free(handles), free(workers);
+        return pack_serial(archive, data, size, a, n);
+    }
+
+    err = pipe_acquire(&pipe, 0);
+    struct coeff_cursor cur = {ctx, 0, false, &ctx->err, &pipe};
+
+    struct bit_reader msg;
+    bit_reader_init(&msg, data, size, 0, (uint64_t) size * 8);
+
+    while (msg.left && !err) {
+        err = embed_group(&cur, a, n, bit_read(&msg, archive->meta.k));
+
+        const int written = pipe_release(&pipe, cur.id);
+        err = err ? err : written;
+    }
+
+    /* Current container is kept as well unless it failed to open */
+    pthread_mutex_lock(&pipe.lock);
+    const bool opened = pipe.state[cur.id] == PIPE_READY;
+    pthread_mutex_unlock(&pipe.lock);
+
+    const int written = pipe_finish(&pipe, handles, started, cur.id + (opened ? 1 : 0));
+    err = err ? err : written;
+
+    if (pipe.pf)
+        prefetch_stop(pipe.pf);
+
+    pthread_cond_destroy(&pipe.cond), pthread_mutex_destroy(&pipe.lock);
+    free(pipe.state), free(handles), free(workers);
+    return err;
+}
+
+int f5ar_pack(f5archive *archive, const char *data, size_t size) {
+    if (!archive->ctx || archive->ctx->filled != archive->ctx->size)
+        return F5AR_NOT_COMPLETE;
 
     archive->ctx->used = 0;
     if (size == 0)
@@ -368,8 +1488,12 @@ int f5ar_pack(f5archive *archive, const char *data, size_t size) {
 
     if (archive->capacity.full + archive->capacity.shrinkable == 0)
         f5ar_analyze(archive);
+    archive->ctx->advised = 0;
 
     archive->meta.msg_size = size;
+    if (archive->meta.layout == F5AR_LAYOUT_SEGMENTED)
+        return pack_segmented(archive, data, size);
+
     if (archive->meta.k == 0)
         archive->meta.k = calc_k(archive->capacity, size);
     size_t n = (1 << archive->meta.k) - 1;
@@ -378,134 +1502,340 @@ int f5ar_pack(f5archive *archive, const char *data, size_t size) {
     if (!a)
         return F5AR_MALLOC_ERR;
 
-    struct linked_container* el = archive->ctx->head;
-    int err = container_open(&el->container, &archive->ctx->err);
+    const int err = (archive->ctx->threads > 1) ? pack_pipelined(archive, data, size, a, n)
+                                                : pack_serial(archive, data, size, a, n);
+    free(a);
+    return err;
+}
+
+
+/* Parallel extraction works in two passes over the same order:
+* first every container is decoded and parities of its nonzero coefficients are saved,
+* then a prefix sum over their counts gives every group its place in the order */
+struct parity_stream {
+    uint8_t** bits;
+    size_t* count;
+    size_t* offset;
+
+    size_t size;
+};
+
+struct parity_job {
+    struct f5archive_ctx* ctx;
+
+    struct parity_stream* stream;
+    int err;
+};
+
+static void parity_task(void *arg, unsigned worker, size_t id) {
+    struct parity_job* job = arg;
+    container_t* container = &job->ctx->containers[id];
+
+    advise_containers(job->ctx, id);
+    const int err = container_open(container, &job->ctx->errs[worker], true);
     if (err) {
-        free(a);
-        return err;
+        task_fail(job->ctx, &job->err, err);
+        return;
     }
 
-    unsigned msg_mask = 1;
-    size_t msg_i = 0;
+    /* Padded to let the extraction read whole words */
+    const size_t count = container->nz.size;
+    uint8_t* bits = calloc(1, count / 8 + sizeof(uint64_t) + 1);
+    if (!bits) {
+        container_close_discard(container);
+        task_fail(job->ctx, &job->err, F5AR_MALLOC_ERR);
+        return;
+    }
 
-    while (msg_i < size && !err) {
-        unsigned kword = 0;
-        for (unsigned k_mask = 1, k_lim = 1 << archive->meta.k; k_mask < k_lim && msg_i < size; k_mask <<= 1) {
-            kword = (data[msg_i] & msg_mask) ? (kword | k_mask) : kword;
+    for (size_t i = 0; i < count; i++)
+        bits[i / 8] |= (*container->nz.coeffs[i] & 1) << (i % 8);
 
-            msg_mask = ((msg_mask <<= 1) == 256) ? 1 : msg_mask;
-            msg_i += (msg_mask == 1) ? 1 : 0;
-        }
+    container_close_discard(container);
+    job->stream->bits[id] = bits,
+    job->stream->count[id] = count;
+}
 
-        struct linked_container* local_el = el;
-        size_t ai = 0;
+/* Index of the container holding global coefficient pos */
+static size_t parity_find(const struct parity_stream* stream, size_t pos) {
+    size_t lo = 0, hi = stream->size;
+    while (hi - lo > 1) {
+        const size_t mid = (lo + hi) / 2;
+        if (stream->offset[mid] <= pos)
+            lo = mid;
+        else
+            hi = mid;
+    }
 
-        while (true) {
-            while (ai < n && !err) {
-                JCOEF coeff = dct_get(local_el->container.dct);
-                if (coeff != 0)
-                    a[ai++] = &dct_get(local_el->container.dct);
-
-                if (c_next(&local_el->container)) {
-                    if (local_el->next) {
-                        local_el = local_el->next;
-                        err = container_open(&local_el->container, &archive->ctx->err);
-                    } else
-                        err = F5AR_FAILURE;
-                }
-            }
+    return lo;
+}
+
+/* Number of groups extracted by a single task, multiple of 8 to keep tasks on separate bytes */
+#define GROUPS_PER_TASK 8192
 
-            if (err)
-                break;
+struct extract_job {
+    const struct parity_stream* stream;
+    unsigned k;
 
-            unsigned s = f5em(a, n) ^ kword;
-            if (s == 0)
-                break;
+    char* msg;
+    uint64_t msg_bits;
+    size_t groups;
+};
 
-            JCOEF val = *(a[s-1]);
-            val += (val > 0) ? -1 : 1;
+/* Takes count <= 64 next parities of the stream as a word */
+static uint64_t parity_take(const struct parity_stream* stream, size_t* c, size_t* bit, unsigned count) {
+    uint64_t word = 0;
+    unsigned got = 0;
 
-            if ((*a[s-1] = val) != 0)
-                break;
+    while (got < count) {
+        while (*bit == stream->count[*c])
+            (*c)++, *bit = 0;
 
-            ai = n-1;
-            while (s < n)
-                a[s-1] = a[s], s++;
-        }
+        const uint8_t* src = stream->bits[*c] + *bit / 8;
+        uint64_t chunk = 0;
+        for (unsigned i = 0; i < sizeof(uint64_t); i++)
+            chunk |= (uint64_t) src[i] << (8 * i);
+        chunk >>= *bit % 8;
+
+        /* At least 56 bits of the chunk are valid */
+        size_t take = count - got;
+        take = (take < 56) ? take : 56;
+        take = (take < stream->count[*c] - *bit) ? take : stream->count[*c] - *bit;
 
-        err = catch_up(archive, &el, local_el);
+        word |= (chunk & (((uint64_t) 1 << take) - 1)) << got;
+        got += (unsigned) take, *bit += take;
     }
 
-    archive->ctx->used++;
-    free(a);
+    return word;
+}
 
-    err = container_close_keep(&el->container, &archive->ctx->err);
-    return err;
+static void extract_task(void *arg, unsigned worker, size_t id) {
+    struct extract_job* job = arg;
+    const size_t n = ((size_t) 1 << job->k) - 1;
+
+    const size_t first = id * GROUPS_PER_TASK;
+    const size_t last = (first + GROUPS_PER_TASK < job->groups) ? first + GROUPS_PER_TASK : job->groups;
+
+    size_t c = parity_find(job->stream, first * n);
+    size_t bit = first * n - job->stream->offset[c];
+
+    struct bit_writer msg;
+    bit_writer_init(&msg, job->msg, (uint64_t) first * job->k, job->msg_bits);
+
+    for (size_t group = first; group < last; group++) {
+        struct syndrome_acc acc = {0, 0, 0};
+        for (size_t i = 0; i < n; i += 64)
+            syndrome_feed(&acc, parity_take(job->stream, &c, &bit, (unsigned) (n - i < 64 ? n - i : 64)));
+
+        bit_write(&msg, syndrome_done(&acc), job->k);
+    }
+
+    bit_flush(&msg);
 }
 
-static unsigned f5ex(const JCOEF *a, size_t n) {
-    unsigned hash = 0;
-    for (size_t i = 0; i < n;)
-        if (a[i++] & 1)
-            hash ^= i;
-    return hash;
+static int unpack_parallel(f5archive *archive, char **res_ptr, size_t *size) {
+    const unsigned k = archive->meta.k;
+    const size_t n = ((size_t) 1 << k) - 1;
+
+    const uint64_t msg_bits = archive->meta.msg_size * 8;
+    const size_t groups = (size_t) ((msg_bits + k - 1) / k);
+
+    struct parity_stream stream = {
+        calloc(sizeof(uint8_t*), archive->ctx->size),
+        calloc(sizeof(size_t), archive->ctx->size),
+        calloc(sizeof(size_t), archive->ctx->size),
+        archive->ctx->size
+    };
+    struct parity_job parity = {archive->ctx, &stream, F5AR_OK};
+    char* msg = calloc(1, archive->meta.msg_size ? archive->meta.msg_size : 1);
+
+    int err = (stream.bits && stream.count && stream.offset && msg) ? F5AR_OK : F5AR_MALLOC_ERR;
+    if (!err)
+        err = parallel_for(&archive->ctx->pool, archive->ctx->size, parity_task, &parity);
+    if (!err)
+        err = parity.err;
+
+    size_t total = 0;
+    for (size_t i = 0; i < stream.size && !err; i++)
+        stream.offset[i] = total, total += stream.count[i];
+
+    if (!err && total < groups * n) {
+        *size = (size_t) (total / n * k / 8);
+        err = F5AR_FAILURE;
+    }
+
+    if (!err) {
+        struct extract_job extract = {&stream, k, msg, msg_bits, groups};
+        err = parallel_for(&archive->ctx->pool, (groups + GROUPS_PER_TASK - 1) / GROUPS_PER_TASK,
+                           extract_task, &extract);
+    }
+
+    for (size_t i = 0; stream.bits && i < stream.size; i++)
+        free(stream.bits[i]);
+    free(stream.bits), free(stream.count), free(stream.offset);
+
+    if (err) {
+        free(msg);
+        return err;
+    }
+
+    *size = archive->meta.msg_size,
+    *res_ptr = msg;
+
+    return F5AR_OK;
+}
+
+static void unpack_segment_task(void *arg, unsigned worker, size_t id) {
+    struct segment_job* job = arg;
+    container_t* container = &job->ctx->containers[id];
+
+    if (!container->segment.bits)
+        return;
+
+    advise_containers(job->ctx, id);
+    int err = container_open(container, &job->ctx->errs[worker], true);
+    if (err) {
+        task_fail(job->ctx, &job->err, err);
+        return;
+    }
+
+    JCOEF* a = job->a[worker];
+    const size_t n = ((size_t) 1 << job->k) - 1;
+
+    struct bit_writer msg;
+    bit_writer_init(&msg, job->msg, container->segment.offset, container->segment.offset + container->segment.bits);
+
+    while (msg.left && !err) {
+        size_t ai = 0;
+        while (ai < n && !err) {
+            if (!nz_exhausted(container))
+                a[ai++] = *nz_next(container);
+            else
+                err = F5AR_FAILURE;
+        }
+
+        if (!err)
+            bit_write(&msg, f5ex(a, n), job->k);
+    }
+
+    bit_flush(&msg);
+    container_close_discard(container);
+    if (err)
+        task_fail(job->ctx, &job->err, err);
+}
+
+static int unpack_segmented(f5archive *archive, char **res_ptr, size_t *size) {
+    /* Imported segments do not overlap, so they cover the whole message only if their sizes add up to it */
+    uint64_t covered = 0;
+    for (uint32_t id = 0; id < archive->ctx->size; id++)
+        covered += archive->ctx->containers[id].segment.bits;
+    if (covered != archive->meta.msg_size * 8)
+        return F5AR_WRONG_ARGS;
+
+    char* msg = calloc(1, archive->meta.msg_size ? archive->meta.msg_size : 1);
+    if (!msg)
+        return F5AR_MALLOC_ERR;
+
+    struct segment_job job = {archive->ctx, NULL, msg, archive->meta.msg_size, archive->meta.k};
+    int err = segment_job_init(&job, archive, sizeof(JCOEF));
+
+    if (!err)
+        err = parallel_for(&archive->ctx->pool, archive->ctx->size, unpack_segment_task, &job);
+    if (!err)
+        err = job.err;
+
+    segment_job_free(&job, archive->ctx->threads);
+    if (err) {
+        free(msg);
+        return err;
+    }
+
+    *size = archive->meta.msg_size,
+    *res_ptr = msg;
+
+    return F5AR_OK;
 }
 
 int f5ar_unpack(f5archive *archive, char **res_ptr, size_t *size) {
+    if (!archive->ctx)
+        return F5AR_NOT_INITIALIZED;
     if (archive->ctx->size != archive->ctx->filled)
         return F5AR_NOT_COMPLETE;
 
+    /* Packing an empty payload leaves k unset, there is nothing to extract */
+    if (archive->meta.msg_size == 0) {
+        if (!(*res_ptr = calloc(1, 1)))
+            return F5AR_MALLOC_ERR;
+
+        *size = 0;
+        return F5AR_OK;
+    }
+
+    if (archive->meta.k == 0 || archive->meta.k > 23)
+        return F5AR_WRONG_ARGS;
+
+    /* A payload is never carried by an empty order */
+    if (!archive->ctx->size)
+        return F5AR_NOT_COMPLETE;
+
+    archive->ctx->advised = 0;
+    if (archive->meta.layout == F5AR_LAYOUT_SEGMENTED)
+        return unpack_segmented(archive, res_ptr, size);
+
+    if (archive->ctx->threads > 1)
+        return unpack_parallel(archive, res_ptr, size);
+
     char* msg = calloc(1, archive->meta.msg_size);
     if (!msg) return F5AR_MALLOC_ERR;
 
     const unsigned k = archive->meta.k, n = (unsigned) ((1 << k) - 1);
-    const unsigned k_mask_max = (unsigned) (1 << k);
 
-    unsigned msg_mask = 1;
-    size_t msg_i = 0;
+    struct bit_writer msg_out;
+    bit_writer_init(&msg_out, msg, 0, archive->meta.msg_size * 8);
 
     JCOEF* a = malloc(sizeof(JCOEF) * n);
-    if (!a)
+    if (!a) {
+        free(msg);
         return F5AR_MALLOC_ERR;
+    }
 
-    struct linked_container *el = archive->ctx->head;
-    int err = container_open(&el->container, &archive->ctx->err);
+    container_t* container = &archive->ctx->containers[0];
+    advise_containers(archive->ctx, 0);
+    int err = container_open(container, &archive->ctx->err, true);
 
-    while (msg_i < archive->meta.msg_size) {
+    while (msg_out.left) {
         unsigned ai = 0;
         while (ai < n && !err) {
-            const JCOEF coeff = dct_get(el->container.dct);
-            if (coeff != 0)
-                a[ai++] = coeff;
-
-            if (c_next(&el->container)) {
-                container_close_discard(&el->container);
-                el = el->next;
-
-                if (el == NULL) {
-                    free(a), free(msg), *size = msg_i + 1;
+            if (!nz_exhausted(container))
+                a[ai++] = *nz_next(container);
+            else {
+                container_close_discard(container);
+
+                /* Whole bytes extracted so far, the writer could still buffer some of them */
+                if (++container == archive->ctx->containers + archive->ctx->size) {
+                    free(a), free(msg), *size = (size_t) ((archive->meta.msg_size * 8 - msg_out.left) / 8);
                     return F5AR_FAILURE;
                 }
 
-                err = container_open(&el->container, &archive->ctx->err);
+                advise_containers(archive->ctx, (size_t) (container - archive->ctx->containers));
+                err = container_open(container, &archive->ctx->err, true);
             }
         }
 
         if (err)
             break;
 
-        unsigned k_word = f5ex(a, n), k_mask = 1;
-        while (k_mask < k_mask_max && msg_i < archive->meta.msg_size) {
-            msg[msg_i] |= (k_word & k_mask) ? msg_mask : 0,
-            msg_mask <<= 1, k_mask <<= 1;
+        bit_write(&msg_out, f5ex(a, n), k);
+    }
 
-            if (msg_mask == 256)
-                msg_mask = 1, msg_i++;
-        }
+    /* Container that failed to open has nothing to close, and the message is not complete */
+    if (err) {
+        free(a), free(msg);
+        return err;
     }
 
+    bit_flush(&msg_out);
     free(a),
-    container_close_discard(&el->container);
+    container_close_discard(container);
 
     *size = archive->meta.msg_size,
     *res_ptr = msg;
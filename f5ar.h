@@ -24,11 +24,25 @@ enum F5AR_CODES {
     F5AR_MALLOC_ERR = -1, F5AR_FILEIO_ERR = -2,
     F5AR_NOT_INITIALIZED = -3, F5AR_NOT_COMPLETE = -5,
     F5AR_FAILURE = -6, F5AR_IO_ERR = -7,
-    F5AR_WRONG_ARGS = -8
+    F5AR_WRONG_ARGS = -8, F5AR_HASH_MISMATCH = -9
+};
+
+/* Stream layout threads the message through the whole order,
+* segmented one gives every container an independent part of it,
+* so they can be packed and unpacked in parallel at the cost of shrinkable capacity */
+enum F5AR_LAYOUT {
+    F5AR_LAYOUT_STREAM = 0, F5AR_LAYOUT_SEGMENTED = 1
+};
+
+/* Files used to be hashed by a broken MD5, orders made back then keep its digests */
+enum F5AR_HASH {
+    F5AR_HASH_MD5 = 0, F5AR_HASH_LEGACY = 1
 };
 
 typedef struct {
     uint8_t k;
+    uint8_t layout;
+    uint8_t hash;
     uint64_t msg_size;
 } f5archive_meta;
 
@@ -49,20 +63,57 @@ typedef struct {
 /* Call this before any operations */
 int f5ar_init(f5archive *);
 
+/* Number of worker threads used by the archive, 0 stands for every online CPU
+* Archive is single-threaded by default. With more threads f5ar_pack() of the stream layout is pipelined:
+* the calling thread embeds while the rest decode containers ahead of it and write finished ones */
+int f5ar_set_threads(f5archive *, unsigned threads);
+
+/* Map files added or filled from now on into memory instead of reading them through stdio,
+* packed ones are written aside and renamed over the originals. Disabled by default */
+int f5ar_set_mapped(f5archive *, int mapped);
+
+/* Read up to depth library files in the background ahead of the analysis, the batch filling and the pipelined packing,
+* through io_uring where the kernel has it. Not used for mapped files, 0 disables it and is the default */
+int f5ar_set_read_ahead(f5archive *, unsigned depth);
+
+/* Ask the kernel to read up to ahead library files beyond the one being decoded or hashed, so a spinning disk
+* streams them instead of seeking on demand. 0 disables it and is the default */
+int f5ar_set_advise(f5archive *, unsigned ahead);
+
 /* Compression API */
 
-/* You can add containers sequentially calling these functions to form new order */
+/* You can add containers sequentially calling these functions to form new order
+* Only the path of a file is kept, it is opened whenever the container is analyzed, packed or hashed,
+* so the number of open descriptors stays within the number of threads whatever the library size is */
 int f5ar_add_file(f5archive *, const char *path);
 
+/* Same as the *add_file() one for files with capacity known beforehand, f5ar_analyze() will not decode them */
+int f5ar_add_file_analyzed(f5archive *, const char *path, f5archive_capacity capacity);
+
 /* size will be updated via the pointer as the file size could change and should contain the original size */
 int f5ar_add_mem(f5archive *archive, void *ptr, size_t* size);
 
 /* Free all used by the archive memory and close all opened file streams */
 void f5ar_destroy(f5archive *);
 
+/* Let the analysis keep up to bytes of decoded containers for the packing to reuse,
+* containers past the limit are decoded again. Nothing is kept by default
+* The same limit bounds files the *fill_file*() functions read whole to hash them,
+* such files are decoded from memory instead of being read again */
+int f5ar_set_cache_limit(f5archive *, size_t bytes);
+
 /* Will be called only once */
 int f5ar_analyze(f5archive *);
 
+/* Returns 1 if the containers analyzed so far surely carry size bytes packed with k bits per group in the layout
+* set by the meta, 0 if they do not. Containers could be added and analyzed again until they do */
+int f5ar_carries(f5archive *, size_t size, unsigned k);
+
+/* Analyzes the order from its start only until the containers surely carry size bytes with k_min bits per group,
+* then sets meta k to the largest k in [k_min, k_max] the analyzed ones carry the message with. f5ar_pack() ignores containers
+* past the needed ones until the next analysis. Returns F5AR_FAILURE if even the whole order falls short at k_min */
+int f5ar_analyze_for(f5archive *, size_t size, unsigned k_min, unsigned k_max);
+
 /* Do compression and fetch the result */
 int f5ar_pack(f5archive *, const char *data, size_t size);
 
@@ -72,6 +123,23 @@ typedef struct {
     char body[];
 } f5ar_blob;
 
+typedef struct {
+    /* NULL for memory containers and empty slots */
+    const char *path;
+
+    /* MD5 of the container, valid for imported and used ones */
+    char hash[16];
+
+    f5archive_capacity capacity;
+    int analyzed;
+
+    /* Container is a part of the packed order */
+    int used;
+} f5ar_info;
+
+/* Describe container with the given position in the order, sequential lookups are the cheapest */
+int f5ar_get_info(f5archive *, size_t id, f5ar_info *);
+
 /* Export order of every container in the archive */
 f5ar_blob *f5ar_export_order(f5archive *);
 
@@ -81,6 +149,7 @@ f5ar_blob *f5ar_export_order_used(f5archive *);
 /* Decompression API */
 
 /* Use this functions to import previously exported order into the other array
+* Segmented orders also keep segment of every container, so set meta before the import
 * This call will destroy the existing archive order and free all associated memory
 * Archive will contain only hashes in the specified order, you need to use **fill**
 * functions to make it suitable for the compression and decompression ones */
@@ -89,9 +158,20 @@ int f5ar_import_order(f5archive *, f5ar_blob *);
 /* Try filling any empty slots in imported order with a file */
 int f5ar_fill_file(f5archive *, const char *path);
 
+/* Same as the *fill_file() one, but takes the hash provided by the caller instead of reading the file
+* The file is hashed while it is decoded, f5ar_unpack() fails with F5AR_HASH_MISMATCH if it does not match */
+int f5ar_fill_file_hashed(f5archive *, const char *path, const char *hash);
+
 /* Same as the *add_mem() one */
 int f5ar_fill_mem(f5archive *archive, void *ptr, size_t* size);
 
+/* Batch versions of the *fill_file() and *fill_mem() ones, files that could not be read or matched are skipped
+* Both stop and return F5AR_OK_COMPLETE as soon as every slot is filled, F5AR_OK otherwise
+* hashes could be NULL, otherwise nonzero ones are taken as the *fill_file_hashed() does and zeroed ones are replaced with computed hashes
+* Files are hashed by the threads set with f5ar_set_threads() */
+int f5ar_fill_files(f5archive *, const char *const *paths, char (*hashes)[16], size_t count);
+int f5ar_fill_mems(f5archive *, void **ptrs, size_t **sizes, size_t count);
+
 int f5ar_unpack(f5archive *, char **res_ptr, size_t *size);
 
 #ifdef __cplusplus
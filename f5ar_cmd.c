@@ -4,6 +4,9 @@
 * This file is distributed under the Beerware licence.
 */
 
+/* syscall() used by the directory crawl is not a part of C99 */
+#define _DEFAULT_SOURCE
+
 #include "f5ar_cmd.h"
 #include "f5ar.h"
 
@@ -12,75 +15,236 @@
 #include <time.h>
 
 #include "f5ar_utils.c"
+#include "f5ar_index.c"
+#include "f5ar_disk.c"
+#include "f5ar_crawl.c"
 
 #define check_throw(action, err) err = action; if (err) return err
 
-static int fill_w_regex(f5archive *archive, const char *path, const regex_t *reg) {
+/* Files with capacity in the index are not decoded again, index could be NULL */
+static int add_library_file(f5archive *archive, const char *path, struct library_index *index) {
+    const struct index_entry* entry = index ? index_lookup(index, path) : NULL;
+    if (entry && (entry->flags & INDEX_CAPACITY))
+        return f5ar_add_file_analyzed(archive, path, entry->capacity) ? -3 : F5AR_OK;
+
+    return f5ar_add_file(archive, path) ? -3 : F5AR_OK;
+}
+
+/* Paths found by the walk, kept to be added in the order they lie on the disk or to be added in chunks */
+struct path_list {
+    char** paths;
+    size_t size, reserved;
+};
+
+static int path_list_push(struct path_list *list, const char *path) {
+    if (list->size == list->reserved) {
+        const size_t reserved = list->reserved ? list->reserved * 2 : 256;
+        char** paths = realloc(list->paths, reserved * sizeof(char*));
+        if (!paths)
+            return F5AR_MALLOC_ERR;
+        list->paths = paths, list->reserved = reserved;
+    }
+
     const size_t path_len = strlen(path);
-    if (path_len >= FILENAME_MAX - 1)
-        return F5AR_OK;
+    if (!(list->paths[list->size] = malloc(path_len + 1)))
+        return F5AR_MALLOC_ERR;
 
-    tinydir_dir dir = {};
-    tinydir_open(&dir, path);
+    memcpy(list->paths[list->size++], path, path_len + 1);
+    return F5AR_OK;
+}
 
-    int err = F5AR_OK;
-    while (dir.has_next && !err) {
-        tinydir_file file;
-        tinydir_readfile(&dir, &file);
+/* Adds every path of the list and empties it */
+static int path_list_add(f5archive *archive, struct path_list *list, struct library_index *index, int disk_ordered) {
+    size_t* order = malloc(sizeof(size_t) * (list->size ? list->size : 1));
+    int err = order ? F5AR_OK : F5AR_MALLOC_ERR;
+
+    for (size_t i = 0; !err && i < list->size; i++)
+        order[i] = i;
+    if (!err && disk_ordered)
+        err = disk_order((const char* const*) list->paths, list->size, order);
+
+    for (size_t i = 0; i < list->size && !err; i++)
+        err = add_library_file(archive, list->paths[order[i]], index);
+
+    for (size_t i = 0; i < list->size; i++)
+        free(list->paths[i]);
+    free(order), list->size = 0;
+
+    return err;
+}
+
+/* Tells if the files added so far are enough to stop the walk, 1 if they are */
+typedef int (*fill_enough_fn)(f5archive *archive, void *arg);
+
+/* Files are taken by chunks of this size when the walk could stop early */
+#define FILL_CHUNK 64
+
+/* Library files are added in the order the crawl finds them, or in the order they lie on the disk if asked to
+* With enough given they are added by chunks, and the crawl is stopped as soon as enough() is satisfied */
+static int fill_w_regex(f5archive *archive, const char *path, const regex_t *reg, struct library_index *index,
+                        int disk_ordered, unsigned threads, fill_enough_fn enough, void *arg) {
+    struct crawl crawl;
+    int err = crawl_start(&crawl, path, reg, threads);
+    if (err)
+        return err;
+
+    /* Without a chunk to wait for, the disk order needs every file found first */
+    const size_t chunk = enough ? FILL_CHUNK : disk_ordered ? SIZE_MAX : 1;
+
+    struct path_list list = {NULL, 0, 0};
+    int satisfied = 0;
+    bool walked = false;
+    while (!err && !satisfied) {
+        struct crawl_node* file = crawl_next(&crawl);
+        if (file) {
+            if (index)
+                index_touch(index, file->path);
+
+            err = path_list_push(&list, file->path);
+            free(file);
+        }
+
+        if (!err && (!file || list.size == chunk)) {
+            err = path_list_add(archive, &list, index, disk_ordered);
+            if (!err && enough && (satisfied = enough(archive, arg)) < 0)
+                err = satisfied;
+        }
+
+        if (!file) {
+            walked = true;
+            break;
+        }
+    }
+
+    const int crawled = crawl_finish(&crawl);
+    err = err ? err : crawled;
+
+    /* Only a walk through the whole library tells which files are gone */
+    if (!err && walked && index)
+        err = index_prune(index);
+
+    for (size_t i = 0; i < list.size; i++)
+        free(list.paths[i]);
+    free(list.paths);
+
+    return err;
+}
+
+/* Packing walks the library only until the files found surely carry the message */
+struct fill_goal {
+    size_t size;
+    unsigned k;
+};
+
+static int fill_goal_reached(f5archive *archive, void *arg) {
+    const struct fill_goal* goal = arg;
+    const int err = f5ar_analyze_for(archive, goal->size, goal->k, goal->k);
+    return (err == F5AR_FAILURE) ? 0 : err ? err : 1;
+}
+
+/* Files are handed to the library in batches, so it could hash them its own way */
+#define FILL_BATCH 256
+static const char unknown_hash[MD5_SIZE];
+
+struct fill_batch {
+    char* paths[FILL_BATCH];
+    char hashes[FILL_BATCH][MD5_SIZE];
+    size_t size;
+
+    /* Files of the batch are hashed in the order they lie on the disk */
+    int disk_ordered;
+};
+
+static void fill_batch_sort(struct fill_batch *batch) {
+    size_t order[FILL_BATCH];
+    if (disk_order((const char* const*) batch->paths, batch->size, order))
+        return;
+
+    char* paths[FILL_BATCH];
+    char hashes[FILL_BATCH][MD5_SIZE];
+    for (size_t i = 0; i < batch->size; i++)
+        paths[i] = batch->paths[order[i]], memcpy(hashes[i], batch->hashes[order[i]], MD5_SIZE);
+
+    memcpy(batch->paths, paths, sizeof(char*) * batch->size);
+    memcpy(batch->hashes, hashes, MD5_SIZE * batch->size);
+}
 
-        if (file.name[0] == '.')
-            goto NEXT;
+/* Hashes computed by the library go to the index, which could be NULL */
+static int fill_batch_flush(f5archive *archive, struct fill_batch *batch, struct library_index *index) {
+    if (batch->disk_ordered)
+        fill_batch_sort(batch);
 
-        if (!file.is_dir) {
-            if (regexec(reg, file.name, 0, 0, 0))
-                goto NEXT;
+    const int err = f5ar_fill_files(archive, (const char* const*) batch->paths, batch->hashes, batch->size);
 
-            if (f5ar_add_file(archive, file.path))
-                err = -3;
-        } else
-            err = fill_w_regex(archive, file.path, reg);
+    for (size_t i = 0; i < batch->size; i++) {
+        struct index_entry* entry = index ? index_lookup(index, batch->paths[i]) : NULL;
+        if (entry && !(entry->flags & INDEX_HASH) && memcmp(batch->hashes[i], unknown_hash, MD5_SIZE))
+            index_set_hash(index, entry, batch->hashes[i]);
 
-        NEXT: tinydir_next(&dir);
+        free(batch->paths[i]);
     }
 
-    tinydir_close(&dir);
+    batch->size = 0;
     return err;
 }
 
-static int fill_w_hashes(f5archive *archive, const char *path) {
+static int fill_batch_push(f5archive *archive, const char *path, struct fill_batch *batch, struct library_index *index) {
+    const struct index_entry* entry = index ? index_touch(index, path) : NULL;
     const size_t path_len = strlen(path);
-    if (path_len == 0 || path_len >= FILENAME_MAX - 1)
-        return F5AR_OK;
 
-    tinydir_dir dir = {};
-    tinydir_open(&dir, path);
+    char** dest = &batch->paths[batch->size];
+    if (!(*dest = malloc(path_len + 1)))
+        return F5AR_MALLOC_ERR;
+    memcpy(*dest, path, path_len + 1);
 
-    int err = F5AR_OK;
-    while (dir.has_next && !err) {
-        tinydir_file file;
-        tinydir_readfile(&dir, &file);
-
-        if (file.name[0] == '.')
-            goto NEXT;
-
-        if (!file.is_dir) {
-            err = f5ar_fill_file(archive, file.path);
-            switch (err) {
-                case F5AR_OK_COMPLETE:
-                    return F5AR_OK;
-                case F5AR_NOT_FOUND:
-                    err = 0;
-            }
-        } else
-            err = fill_w_hashes(archive, file.path);
+    /* Zeroed hash is computed by the library */
+    memcpy(batch->hashes[batch->size], (entry && (entry->flags & INDEX_HASH)) ? entry->hash : unknown_hash, MD5_SIZE);
+
+    return (++batch->size == FILL_BATCH) ? fill_batch_flush(archive, batch, index) : F5AR_OK;
+}
+
+/* Files with hash in the index are not read until they fill a slot, index could be NULL */
+/* The crawl is stopped as soon as every slot is filled */
+static int fill_w_hashes(f5archive *archive, const char *path, struct library_index *index,
+                         int disk_ordered, unsigned threads) {
+    struct fill_batch* batch = malloc(sizeof(struct fill_batch));
+    if (!batch)
+        return F5AR_MALLOC_ERR;
+
+    struct crawl crawl;
+    int err = crawl_start(&crawl, path, NULL, threads);
+    if (err) {
+        free(batch);
+        return F5AR_FAILURE;
+    }
 
-        NEXT: tinydir_next(&dir);
+    batch->size = 0, batch->disk_ordered = disk_ordered;
+    struct crawl_node* file;
+    while (err == F5AR_OK && (file = crawl_next(&crawl))) {
+        err = fill_batch_push(archive, file->path, batch, index);
+        free(file);
     }
 
-    tinydir_close(&dir);
-    return F5AR_FAILURE;
+    /* Only a walk through the whole library tells which files are gone */
+    const bool walked = err == F5AR_OK;
+    const int crawled = crawl_finish(&crawl);
+    if (err == F5AR_OK)
+        err = crawled ? crawled : fill_batch_flush(archive, batch, index);
+    if ((err == F5AR_OK || err == F5AR_OK_COMPLETE) && walked && index && index_prune(index))
+        err = F5AR_MALLOC_ERR;
+
+    for (size_t i = 0; i < batch->size; i++)
+        free(batch->paths[i]);
+    free(batch);
+
+    return (err == F5AR_OK_COMPLETE) ? F5AR_OK : F5AR_FAILURE;
 }
 
+/* Layout is kept in the high bit of k in the archive file,
+* the next one marks archives hashed by the fixed MD5 */
+#define K_SEGMENTED 0x80
+#define K_MD5 0x40
+
 #define fread_err(dest, size, file) fread(dest, 1, size, file) != size
 static int archive_read(f5archive *archive, const char *path) {
     int err = 0;
@@ -99,6 +263,10 @@ static int archive_read(f5archive *archive, const char *path) {
         goto CLOSE;
     }
 
+    archive->meta.layout = (archive->meta.k & K_SEGMENTED) ? F5AR_LAYOUT_SEGMENTED : F5AR_LAYOUT_STREAM,
+    archive->meta.hash = (archive->meta.k & K_MD5) ? F5AR_HASH_MD5 : F5AR_HASH_LEGACY,
+    archive->meta.k &= ~(K_SEGMENTED | K_MD5);
+
     f5ar_blob* order = malloc(sizeof(f5ar_blob) + order_size);
     if (!order) {
         err = F5AR_MALLOC_ERR;
@@ -134,7 +302,9 @@ static int archive_write(f5archive* archive, const char* path) {
     }
 
     const uint64_t order_size64 = order->size;
-    if (fwrite_err(&archive->meta.k, sizeof(uint8_t), out) ||
+    const uint8_t k = archive->meta.k | (archive->meta.layout == F5AR_LAYOUT_SEGMENTED ? K_SEGMENTED : 0) |
+                      (archive->meta.hash == F5AR_HASH_MD5 ? K_MD5 : 0);
+    if (fwrite_err(&k, sizeof(uint8_t), out) ||
         fwrite_err(&archive->meta.msg_size, sizeof(uint64_t), out) ||
         fwrite_err(&order_size64, sizeof(uint64_t), out) ||
         fwrite_err(order->body, order->size, out))
@@ -144,6 +314,47 @@ static int archive_write(f5archive* archive, const char* path) {
     EXIT: return err;
 }
 
+static int is_number(const char* str) {
+    if (!*str)
+        return 0;
+
+    for (; *str; str++)
+        if (*str < '0' || *str > '9')
+            return 0;
+    return 1;
+}
+
+/* Strips every "flag [value]" from the arguments, returns 1 if the flag was there
+* Value may be glued to the flag, numeric ones are optional and taken only if they are all digits,
+* so a file name starting with a digit stays a positional argument */
+enum FLAG_VALUE { FLAG_BARE, FLAG_NUMBER };
+static int take_flag(int *argc, char* argv[], const char* flag, int type, unsigned long* value) {
+    const size_t flag_len = strlen(flag);
+    int found = 0;
+
+    for (int i = 2; i < *argc; i++) {
+        if (strncmp(argv[i], flag, flag_len) ||
+            (argv[i][flag_len] && (type == FLAG_BARE || !is_number(argv[i] + flag_len))))
+            continue;
+
+        int taken = 1;
+        if (type == FLAG_NUMBER) {
+            if (argv[i][flag_len])
+                *value = strtoul(argv[i] + flag_len, NULL, 10);
+            else if (i + 1 < *argc && is_number(argv[i + 1]))
+                *value = strtoul(argv[i + 1], NULL, 10), taken = 2;
+            else
+                *value = 0;
+        }
+
+        for (int j = i; j + taken < *argc; j++)
+            argv[j] = argv[j + taken];
+        *argc -= taken, i--, found = 1;
+    }
+
+    return found;
+}
+
 static void usage(char* argv[], int verbose) {
     if (!verbose)
         return;
@@ -155,6 +366,17 @@ static void usage(char* argv[], int verbose) {
     printf("-u [archive] [file]                  \nDecompress [archive] and write result to the [file]\n\n");
     printf("-a [folder] [regex]                  \nAnalyse ([folder], [regex]) library capacity\n\n");
 
+    printf("Options:\n");
+    printf("-j [threads]                         \nUse [threads] worker threads, every CPU if omitted\n\n");
+    printf("-s                                   \nPack into independent per-container segments, faster with -j\n\n");
+    printf("-m [megabytes]                       \nReuse up to [megabytes] of containers decoded by the analysis or read while unpacking, no limit if omitted\n\n");
+    printf("-M                                   \nMap library files into memory instead of reading them\n\n");
+    printf("-r [depth]                           \nRead up to [depth] library files ahead in the background, 64 if omitted\n\n");
+    printf("-k [k]                               \nEmbed [k] bits per group instead of choosing k by the library capacity\n\n");
+    printf("-e                                   \nAnalyse library files as they are found and stop once they surely carry [file] at k, 1 if -k is not given.\nOnly files needed are used, with the largest k they carry [file] with\n\n");
+    printf("-d [count]                           \nGo through library files in the order they lie on the disk and let the kernel read [count] of them ahead, 8 if omitted\n\n");
+    printf("-i                                   \nKeep hashes and capacities of the library files in the " INDEX_NAME " file at its root\n\n");
+
     printf("Examples:\n\n");
     printf("Compress in.txt into *.jpg files in dogs folder and save as doge.arch:\n");
     printf("%s -p dogs/ .*\\.jpg in.txt doge.arch\n\n", argv[0]);
@@ -210,6 +432,36 @@ int f5ar_cmd_exec(int argc, char* argv[], int verbose) {
     f5archive archive;
     memset(&archive, 0, sizeof(f5archive));
 
+    unsigned long threads = 1;
+    take_flag(&argc, argv, "-j", FLAG_NUMBER, &threads);
+
+    archive.meta.layout = take_flag(&argc, argv, "-s", FLAG_BARE, NULL) ? F5AR_LAYOUT_SEGMENTED : F5AR_LAYOUT_STREAM;
+
+    unsigned long cache_mb = 0;
+    if (take_flag(&argc, argv, "-m", FLAG_NUMBER, &cache_mb) && cache_mb == 0)
+        cache_mb = SIZE_MAX >> 20;
+
+    const int indexed = take_flag(&argc, argv, "-i", FLAG_BARE, NULL);
+    const int mapped = take_flag(&argc, argv, "-M", FLAG_BARE, NULL);
+
+    unsigned long read_ahead = 0;
+    if (take_flag(&argc, argv, "-r", FLAG_NUMBER, &read_ahead) && read_ahead == 0)
+        read_ahead = 64;
+
+    unsigned long k = 0;
+    take_flag(&argc, argv, "-k", FLAG_NUMBER, &k);
+    if (k > 23) {
+        usage(argv, verbose);
+        return F5AR_WRONG_ARGS;
+    }
+    archive.meta.k = (uint8_t) k;
+
+    const int early = take_flag(&argc, argv, "-e", FLAG_BARE, NULL);
+    unsigned long advise = 0;
+    if (take_flag(&argc, argv, "-d", FLAG_NUMBER, &advise) && advise == 0)
+        advise = 8;
+    struct library_index index;
+
     switch (argv[1][1]) {
         case 'p': {
             if (argc < 6) {
@@ -235,11 +487,28 @@ int f5ar_cmd_exec(int argc, char* argv[], int verbose) {
                 }
 
                 check_throw(f5ar_init(&archive), err);
-                fill_w_regex(&archive, argv[2], &regex);
+                check_throw(f5ar_set_threads(&archive, (unsigned) threads), err);
+                check_throw(f5ar_set_cache_limit(&archive, (size_t) cache_mb << 20), err);
+                check_throw(f5ar_set_mapped(&archive, mapped), err);
+                check_throw(f5ar_set_read_ahead(&archive, (unsigned) read_ahead), err);
+                check_throw(f5ar_set_advise(&archive, (unsigned) advise), err);
+                if (indexed)
+                    check_throw(index_load(&index, argv[2]), err);
+
+                struct fill_goal goal = {msg_size, k ? (unsigned) k : 1};
+                fill_w_regex(&archive, argv[2], &regex, indexed ? &index : NULL, advise != 0, (unsigned) threads,
+                             early ? fill_goal_reached : NULL, &goal);
                 regfree(&regex);
             }), verbose);
 
-            do_timed_action(Analysing library capacity, check_throw(f5ar_analyze(&archive), err), verbose);
+            /* Early packing analyzes only the files it needs and picks the largest k they carry the file with */
+            do_timed_action(Analysing library capacity, ({
+                err = early ? f5ar_analyze_for(&archive, msg_size, k ? (unsigned) k : 1, k ? (unsigned) k : 23) :
+                      f5ar_analyze(&archive);
+                if (err && err != F5AR_FAILURE) return err;
+            }), verbose);
+            if (indexed)
+                index_store_capacities(&index, &archive);
             check_capacity(archive, msg_size, verbose);
 
             do_timed_action(Compressing, ({
@@ -260,6 +529,14 @@ int f5ar_cmd_exec(int argc, char* argv[], int verbose) {
 
                 check_throw(archive_write(&archive, archive_path), err);
             }), verbose);
+
+            if (indexed) {
+                do_timed_action(Updating the library index, ({
+                    index_store_packed(&index, &archive);
+                    index_save(&index);
+                    index_free(&index);
+                }), verbose);
+            }
         } break;
 
         case 'u': {
@@ -268,8 +545,15 @@ int f5ar_cmd_exec(int argc, char* argv[], int verbose) {
                 return F5AR_WRONG_ARGS;
             }
 
-            do_timed_action(Initializing the archive, check_throw(f5ar_init(&archive), err), verbose);
-            do_timed_action(Reading the archive file, archive_read(&archive, argv[2]), verbose);
+            do_timed_action(Initializing the archive, ({
+                check_throw(f5ar_init(&archive), err);
+                check_throw(f5ar_set_threads(&archive, (unsigned) threads), err);
+                check_throw(f5ar_set_cache_limit(&archive, (size_t) cache_mb << 20), err);
+                check_throw(f5ar_set_mapped(&archive, mapped), err);
+                check_throw(f5ar_set_read_ahead(&archive, (unsigned) read_ahead), err);
+                check_throw(f5ar_set_advise(&archive, (unsigned) advise), err);
+            }), verbose);
+            do_timed_action(Reading the archive file, check_throw(archive_read(&archive, argv[2]), err), verbose);
 
             do_timed_action(Filling the archive with files, ({
                 char dir_path[FILENAME_MAX];
@@ -277,7 +561,15 @@ int f5ar_cmd_exec(int argc, char* argv[], int verbose) {
 
                 extract_dir_path(dir_path, argv[2]);
 
-                if (fill_w_hashes(&archive, dir_path))
+                if (indexed)
+                    check_throw(index_load(&index, dir_path), err);
+                /* Index keeps plain MD5 digests only */
+                err = fill_w_hashes(&archive, dir_path, (indexed && archive.meta.hash == F5AR_HASH_MD5) ? &index : NULL,
+                                    advise != 0, (unsigned) threads);
+
+                if (indexed)
+                    index_save(&index), index_free(&index);
+                if (err)
                     return F5AR_NOT_COMPLETE;
             }), verbose);
 
@@ -311,11 +603,21 @@ int f5ar_cmd_exec(int argc, char* argv[], int verbose) {
                 }
 
                 check_throw(f5ar_init(&archive), err);
-                fill_w_regex(&archive, argv[2], &regex);
+                check_throw(f5ar_set_threads(&archive, (unsigned) threads), err);
+                check_throw(f5ar_set_mapped(&archive, mapped), err);
+                check_throw(f5ar_set_read_ahead(&archive, (unsigned) read_ahead), err);
+                check_throw(f5ar_set_advise(&archive, (unsigned) advise), err);
+                if (indexed)
+                    check_throw(index_load(&index, argv[2]), err);
+                fill_w_regex(&archive, argv[2], &regex, indexed ? &index : NULL, advise != 0, (unsigned) threads, NULL, NULL);
                 regfree(&regex);
             }), verbose);
 
             do_timed_action(Analysing library capacity, f5ar_analyze(&archive), verbose);
+            if (indexed) {
+                index_store_capacities(&index, &archive);
+                index_save(&index), index_free(&index);
+            }
 
             printf("Detected somewhatguaranteed capacity of %zu bytes\nDetected possible capacity of upto %zu bytes\n",
                    archive.capacity.full / 8,
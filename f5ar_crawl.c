@@ -0,0 +1,303 @@
+/* Parallel walk over the library tree, files found are queued for a single consumer to take
+* Workers share a stack of directories to read, so both deep and wide trees keep all of them busy.
+* Directories are read with getdents64 on Linux, through tinydir elsewhere */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <dirent.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(__linux__) && defined(SYS_getdents64)
+#define CRAWL_GETDENTS
+#endif
+
+/* Found entries go to the shared lists in chunks of this size */
+#define CRAWL_FLUSH 256
+
+struct crawl_node {
+    struct crawl_node* next;
+    char path[];
+};
+
+struct crawl_list {
+    struct crawl_node *head, *tail;
+    size_t size;
+};
+
+struct crawl {
+    const regex_t* reg;
+
+    /* Directories waiting to be read and the number of ones being read */
+    struct crawl_list dirs;
+    unsigned busy;
+
+    struct crawl_list files;
+    unsigned running;
+    bool stop;
+    int err;
+
+    pthread_t* handles;
+    unsigned started;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+static void crawl_list_push(struct crawl_list* list, struct crawl_node* node) {
+    node->next = NULL;
+    if (list->tail)
+        list->tail->next = node;
+    else
+        list->head = node;
+    list->tail = node, list->size++;
+}
+
+static void crawl_list_splice(struct crawl_list* dest, struct crawl_list* src) {
+    if (!src->head)
+        return;
+
+    if (dest->tail)
+        dest->tail->next = src->head;
+    else
+        dest->head = src->head;
+    dest->tail = src->tail, dest->size += src->size;
+
+    src->head = src->tail = NULL, src->size = 0;
+}
+
+static void crawl_list_free(struct crawl_list* list) {
+    while (list->head) {
+        struct crawl_node* next = list->head->next;
+        free(list->head);
+        list->head = next;
+    }
+    list->tail = NULL, list->size = 0;
+}
+
+static bool crawl_fits(const char* dir, const char* name) {
+    return strlen(dir) + strlen(name) + 2 <= FILENAME_MAX;
+}
+
+static struct crawl_node* crawl_node_new(const char* dir, const char* name) {
+    const size_t dir_len = strlen(dir), name_len = strlen(name);
+    struct crawl_node* node = malloc(sizeof(struct crawl_node) + dir_len + name_len + 2);
+    if (!node)
+        return NULL;
+
+    memcpy(node->path, dir, dir_len), node->path[dir_len] = '/';
+    memcpy(node->path + dir_len + 1, name, name_len + 1);
+    return node;
+}
+
+/* Entries found so far are handed over, directories go on top of the stack. Call it holding the lock */
+static void crawl_hand_over(struct crawl* crawl, struct crawl_list* dirs, struct crawl_list* files) {
+    crawl_list_splice(dirs, &crawl->dirs);
+    crawl->dirs = *dirs, dirs->head = dirs->tail = NULL, dirs->size = 0;
+
+    crawl_list_splice(&crawl->files, files);
+    pthread_cond_broadcast(&crawl->cond);
+}
+
+/* Hidden entries are skipped, files are matched by the name only */
+static int crawl_entry(struct crawl* crawl, const char* dir, const char* name, bool is_dir,
+                       struct crawl_list* dirs, struct crawl_list* files) {
+    if (name[0] == '.' || !crawl_fits(dir, name) || (!is_dir && crawl->reg && regexec(crawl->reg, name, 0, 0, 0)))
+        return F5AR_OK;
+
+    struct crawl_node* node = crawl_node_new(dir, name);
+    if (!node)
+        return F5AR_MALLOC_ERR;
+
+    crawl_list_push(is_dir ? dirs : files, node);
+    if (dirs->size + files->size >= CRAWL_FLUSH) {
+        pthread_mutex_lock(&crawl->lock);
+        crawl_hand_over(crawl, dirs, files);
+        pthread_mutex_unlock(&crawl->lock);
+    }
+
+    return F5AR_OK;
+}
+
+#ifdef CRAWL_GETDENTS
+struct crawl_dirent {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+static int crawl_dir(struct crawl* crawl, const char* dir, struct crawl_list* dirs, struct crawl_list* files) {
+    const int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+        return F5AR_OK;
+
+    uint64_t buffer[4096];
+    int err = F5AR_OK;
+
+    long got;
+    while (!err && (got = syscall(SYS_getdents64, fd, buffer, sizeof(buffer))) > 0) {
+        for (long pos = 0; pos < got && !err;) {
+            const struct crawl_dirent* entry = (const struct crawl_dirent*) ((char*) buffer + pos);
+            pos += entry->d_reclen;
+
+            /* Links and entries of filesystems not telling the type are looked at the way stat() sees them */
+            bool is_dir = entry->d_type == DT_DIR;
+            if ((entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN) && entry->d_name[0] != '.' &&
+                crawl_fits(dir, entry->d_name)) {
+                struct crawl_node* node = crawl_node_new(dir, entry->d_name);
+                struct stat st;
+
+                if (!node) {
+                    err = F5AR_MALLOC_ERR;
+                    break;
+                }
+
+                is_dir = !stat(node->path, &st) && S_ISDIR(st.st_mode);
+                free(node);
+            }
+
+            err = crawl_entry(crawl, dir, entry->d_name, is_dir, dirs, files);
+        }
+    }
+
+    close(fd);
+    return err;
+}
+#else
+static int crawl_dir(struct crawl* crawl, const char* dir, struct crawl_list* dirs, struct crawl_list* files) {
+    tinydir_dir td = {};
+    if (tinydir_open(&td, dir))
+        return F5AR_OK;
+
+    int err = F5AR_OK;
+    for (; td.has_next && !err; tinydir_next(&td)) {
+        tinydir_file file;
+        if (!tinydir_readfile(&td, &file))
+            err = crawl_entry(crawl, dir, file.name, file.is_dir, dirs, files);
+    }
+
+    tinydir_close(&td);
+    return err;
+}
+#endif
+
+static void* crawl_worker_run(void* arg) {
+    struct crawl* crawl = arg;
+
+    pthread_mutex_lock(&crawl->lock);
+    while (true) {
+        while (!crawl->dirs.head && crawl->busy && !crawl->stop)
+            pthread_cond_wait(&crawl->cond, &crawl->lock);
+
+        if (crawl->stop || !crawl->dirs.head)
+            break;
+
+        /* Last found directory is read first, so the stack grows with the depth of the tree rather than its width */
+        struct crawl_node* dir = crawl->dirs.head;
+        crawl->dirs.head = dir->next, crawl->dirs.size--;
+        if (!crawl->dirs.head)
+            crawl->dirs.tail = NULL;
+        crawl->busy++;
+        pthread_mutex_unlock(&crawl->lock);
+
+        struct crawl_list dirs = {NULL, NULL, 0}, files = {NULL, NULL, 0};
+        const int err = crawl_dir(crawl, dir->path, &dirs, &files);
+        free(dir);
+
+        pthread_mutex_lock(&crawl->lock);
+        crawl_hand_over(crawl, &dirs, &files);
+        crawl->err = crawl->err ? crawl->err : err;
+        crawl->stop |= err != F5AR_OK;
+        crawl->busy--;
+    }
+
+    crawl->running--;
+    pthread_cond_broadcast(&crawl->cond);
+    pthread_mutex_unlock(&crawl->lock);
+    return NULL;
+}
+
+/* Starts walking the tree under root with up to threads workers, every CPU is used for 0 */
+static int crawl_start(struct crawl* crawl, const char* root, const regex_t* reg, unsigned threads) {
+    memset(crawl, 0, sizeof(struct crawl));
+    crawl->reg = reg;
+
+    if (!threads) {
+        const long online = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = online > 0 ? (unsigned) online : 1;
+    }
+
+    const size_t root_len = strlen(root);
+    struct crawl_node* node = (root_len && root_len < FILENAME_MAX - 1) ?
+            malloc(sizeof(struct crawl_node) + root_len + 1) : NULL;
+    if (!node)
+        return root_len ? F5AR_MALLOC_ERR : F5AR_WRONG_ARGS;
+
+    memcpy(node->path, root, root_len + 1);
+    crawl_list_push(&crawl->dirs, node);
+
+    if (!(crawl->handles = malloc(sizeof(pthread_t) * threads)))
+        goto FAIL;
+    if (pthread_mutex_init(&crawl->lock, NULL))
+        goto FAIL;
+    if (pthread_cond_init(&crawl->cond, NULL)) {
+        pthread_mutex_destroy(&crawl->lock);
+        goto FAIL;
+    }
+
+    pthread_mutex_lock(&crawl->lock);
+    while (crawl->started < threads && !pthread_create(&crawl->handles[crawl->started], NULL, crawl_worker_run, crawl))
+        crawl->started++, crawl->running++;
+    pthread_mutex_unlock(&crawl->lock);
+
+    if (crawl->started)
+        return F5AR_OK;
+
+    pthread_cond_destroy(&crawl->cond), pthread_mutex_destroy(&crawl->lock);
+
+    FAIL:
+    crawl_list_free(&crawl->dirs);
+    free(crawl->handles), crawl->handles = NULL;
+    return F5AR_FAILURE;
+}
+
+/* Waits for the next file found, NULL once the walk is over. Free the node after use */
+static struct crawl_node* crawl_next(struct crawl* crawl) {
+    pthread_mutex_lock(&crawl->lock);
+    while (!crawl->files.head && crawl->running)
+        pthread_cond_wait(&crawl->cond, &crawl->lock);
+
+    struct crawl_node* node = crawl->files.head;
+    if (node) {
+        crawl->files.head = node->next, crawl->files.size--;
+        if (!crawl->files.head)
+            crawl->files.tail = NULL;
+    }
+    pthread_mutex_unlock(&crawl->lock);
+
+    return node;
+}
+
+/* Stops the walk even if it is not over, returns the first error workers ran into */
+static int crawl_finish(struct crawl* crawl) {
+    pthread_mutex_lock(&crawl->lock);
+    crawl->stop = true;
+    pthread_cond_broadcast(&crawl->cond);
+    pthread_mutex_unlock(&crawl->lock);
+
+    for (unsigned i = 0; i < crawl->started; i++)
+        pthread_join(crawl->handles[i], NULL);
+
+    crawl_list_free(&crawl->dirs), crawl_list_free(&crawl->files);
+    pthread_cond_destroy(&crawl->cond), pthread_mutex_destroy(&crawl->lock);
+    free(crawl->handles);
+
+    return crawl->err;
+}
@@ -0,0 +1,73 @@
+/* Placement of library files on the disk, so a spinning one reads them without seeking back and forth
+* Files are ordered by the physical offset of their first extent as FIEMAP reports it,
+* files the filesystem tells nothing about go first and are ordered by inode */
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include <sys/ioctl.h>
+#endif
+
+struct disk_place {
+    uint64_t physical;
+    uint64_t inode;
+    size_t id;
+};
+
+static struct disk_place disk_locate(const char* path, size_t id) {
+    struct disk_place place = {0, 0, id};
+
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return place;
+
+    struct stat st;
+    if (!fstat(fd, &st))
+        place.inode = (uint64_t) st.st_ino;
+
+#ifdef FS_IOC_FIEMAP
+    /* Only the first extent is asked for */
+    uint64_t request[(sizeof(struct fiemap) + sizeof(struct fiemap_extent)) / sizeof(uint64_t) + 1];
+    memset(request, 0, sizeof(request));
+
+    struct fiemap* map = (struct fiemap*) request;
+    map->fm_length = FIEMAP_MAX_OFFSET, map->fm_extent_count = 1;
+    if (!ioctl(fd, FS_IOC_FIEMAP, map) && map->fm_mapped_extents)
+        place.physical = map->fm_extents[0].fe_physical;
+#endif
+
+    close(fd);
+    return place;
+}
+
+static int disk_place_cmp(const void* a, const void* b) {
+    const struct disk_place* l = a;
+    const struct disk_place* r = b;
+
+    if (l->physical != r->physical)
+        return (l->physical < r->physical) ? -1 : 1;
+    if (l->inode != r->inode)
+        return (l->inode < r->inode) ? -1 : 1;
+    return (l->id < r->id) ? -1 : (l->id > r->id);
+}
+
+/* Puts ids of the paths into order the way they lie on the disk */
+static int disk_order(const char* const* paths, size_t count, size_t* order) {
+    struct disk_place* places = malloc(sizeof(struct disk_place) * (count ? count : 1));
+    if (!places)
+        return F5AR_MALLOC_ERR;
+
+    for (size_t id = 0; id < count; id++)
+        places[id] = disk_locate(paths[id], id);
+    qsort(places, count, sizeof(struct disk_place), disk_place_cmp);
+
+    for (size_t i = 0; i < count; i++)
+        order[i] = places[i].id;
+
+    free(places);
+    return F5AR_OK;
+}
@@ -0,0 +1,306 @@
+/* Library index kept at the library root between runs
+* Maps path relative to the root to size, mtime, MD5 and capacity of the file,
+* entries are trusted only while size, inode and mtime with its nanoseconds reported by stat() stay the same,
+* as packing rewrites a file well within a second */
+
+#include <stdbool.h>
+#include <sys/stat.h>
+
+#include "md5.h"
+
+#define INDEX_NAME ".f5ar_index"
+#define INDEX_MAGIC "F5IX"
+#define INDEX_VERSION 3
+
+#ifdef __APPLE__
+#define index_mtime_nsec(st) ((st).st_mtimespec.tv_nsec)
+#else
+#define index_mtime_nsec(st) ((st).st_mtim.tv_nsec)
+#endif
+
+enum INDEX_FLAGS { INDEX_HASH = 1, INDEX_CAPACITY = 2 };
+
+struct index_entry {
+    char* path;
+
+    uint64_t size;
+    int64_t mtime;
+    int64_t mtime_nsec;
+    uint64_t inode;
+
+    /* Found by the walk of this run, the rest are dropped once a walk goes through the whole library */
+    bool seen;
+
+    uint8_t flags;
+    char hash[MD5_SIZE];
+    f5archive_capacity capacity;
+};
+
+struct library_index {
+    char path[FILENAME_MAX];
+    size_t root_len;
+
+    struct index_entry* entries;
+    size_t size, reserved;
+
+    /* Open addressing over entries, slot keeps entry id + 1 */
+    size_t* slots;
+    size_t slots_size;
+
+    int dirty;
+};
+
+static uint64_t index_path_hash(const char* path) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (; *path; path++)
+        hash = (hash ^ (uint8_t) *path) * 1099511628211ULL;
+    return hash;
+}
+
+/* Path relative to the library root, so the index survives moving the library */
+static const char* index_relative(const struct library_index* index, const char* path) {
+    if (strncmp(path, index->path, index->root_len) == 0)
+        path += index->root_len;
+
+    while (*path == '/')
+        path++;
+    return path;
+}
+
+static size_t* index_slot(const struct library_index* index, const char* rel) {
+    size_t slot = (size_t) index_path_hash(rel) & (index->slots_size - 1);
+    while (index->slots[slot] && strcmp(index->entries[index->slots[slot] - 1].path, rel))
+        slot = (slot + 1) & (index->slots_size - 1);
+    return &index->slots[slot];
+}
+
+static int index_rehash(struct library_index* index, size_t slots_size) {
+    size_t* slots = calloc(slots_size, sizeof(size_t));
+    if (!slots)
+        return F5AR_MALLOC_ERR;
+
+    free(index->slots);
+    index->slots = slots, index->slots_size = slots_size;
+
+    for (size_t id = 0; id < index->size; id++)
+        *index_slot(index, index->entries[id].path) = id + 1;
+    return F5AR_OK;
+}
+
+static struct index_entry* index_append(struct library_index* index, const char* rel) {
+    if (index->size == index->reserved) {
+        const size_t reserved = index->reserved ? index->reserved * 2 : 1024;
+        struct index_entry* entries = realloc(index->entries, reserved * sizeof(struct index_entry));
+        if (!entries)
+            return NULL;
+        index->entries = entries, index->reserved = reserved;
+    }
+
+    if (2 * (index->size + 1) > index->slots_size &&
+        index_rehash(index, index->slots_size ? index->slots_size * 2 : 2048))
+        return NULL;
+
+    struct index_entry* entry = &index->entries[index->size];
+    memset(entry, 0, sizeof(struct index_entry));
+
+    const size_t rel_len = strlen(rel);
+    if (!(entry->path = malloc(rel_len + 1)))
+        return NULL;
+    memcpy(entry->path, rel, rel_len + 1);
+
+    *index_slot(index, rel) = ++index->size;
+    return entry;
+}
+
+#define fread_fail(dest, size, file) (fread(dest, 1, size, file) != (size))
+static int index_load(struct library_index* index, const char* root) {
+    memset(index, 0, sizeof(struct library_index));
+
+    index->root_len = strlen(root);
+    if (index->root_len + sizeof(INDEX_NAME) + 1 >= FILENAME_MAX)
+        return F5AR_WRONG_ARGS;
+
+    snprintf(index->path, FILENAME_MAX, "%s/" INDEX_NAME, root);
+
+    /* Missing or broken index means starting from scratch */
+    FILE* in = fopen(index->path, "rb");
+    if (!in)
+        return F5AR_OK;
+
+    char magic[4];
+    uint8_t version;
+    uint64_t count;
+    if (fread_fail(magic, 4, in) || memcmp(magic, INDEX_MAGIC, 4) ||
+        fread_fail(&version, 1, in) || version != INDEX_VERSION ||
+        fread_fail(&count, sizeof(uint64_t), in))
+        goto CLOSE;
+
+    for (uint64_t i = 0; i < count; i++) {
+        uint16_t path_len;
+        char rel[FILENAME_MAX];
+        if (fread_fail(&path_len, sizeof(uint16_t), in) || path_len >= FILENAME_MAX ||
+            fread_fail(rel, path_len, in))
+            break;
+        rel[path_len] = '\0';
+
+        struct index_entry read;
+        uint64_t full, shrinkable;
+        if (fread_fail(&read.size, sizeof(uint64_t), in) ||
+            fread_fail(&read.mtime, sizeof(int64_t), in) ||
+            fread_fail(&read.mtime_nsec, sizeof(int64_t), in) ||
+            fread_fail(&read.inode, sizeof(uint64_t), in) ||
+            fread_fail(&read.flags, sizeof(uint8_t), in) ||
+            fread_fail(read.hash, MD5_SIZE, in) ||
+            fread_fail(&full, sizeof(uint64_t), in) ||
+            fread_fail(&shrinkable, sizeof(uint64_t), in))
+            break;
+
+        struct index_entry* entry = index_append(index, rel);
+        if (!entry)
+            break;
+
+        read.path = entry->path, read.seen = false,
+        read.capacity.full = (size_t) full, read.capacity.shrinkable = (size_t) shrinkable;
+        *entry = read;
+    }
+
+    CLOSE: fclose(in);
+    return F5AR_OK;
+}
+
+/* Entry of the file if it was not changed since being indexed */
+static struct index_entry* index_lookup(struct library_index* index, const char* path) {
+    if (!index->size)
+        return NULL;
+
+    const size_t slot = *index_slot(index, index_relative(index, path));
+    return slot ? &index->entries[slot - 1] : NULL;
+}
+
+/* Finds or creates an entry of the file, forgetting everything known if the file changed */
+static struct index_entry* index_touch(struct library_index* index, const char* path) {
+    struct stat st;
+    if (stat(path, &st))
+        return NULL;
+
+    struct index_entry* entry = index_lookup(index, path);
+    if (!entry && !(entry = index_append(index, index_relative(index, path))))
+        return NULL;
+
+    if (entry->size != (uint64_t) st.st_size || entry->mtime != (int64_t) st.st_mtime ||
+        entry->mtime_nsec != (int64_t) index_mtime_nsec(st) || entry->inode != (uint64_t) st.st_ino)
+        entry->size = (uint64_t) st.st_size, entry->mtime = (int64_t) st.st_mtime,
+        entry->mtime_nsec = (int64_t) index_mtime_nsec(st), entry->inode = (uint64_t) st.st_ino,
+        entry->flags = 0, index->dirty = 1;
+
+    entry->seen = true;
+    return entry;
+}
+
+static void index_set_hash(struct library_index* index, struct index_entry* entry, const char* hash) {
+    memcpy(entry->hash, hash, MD5_SIZE);
+    entry->flags |= INDEX_HASH, index->dirty = 1;
+}
+
+static void index_set_capacity(struct library_index* index, struct index_entry* entry, f5archive_capacity capacity) {
+    entry->capacity = capacity;
+    entry->flags |= INDEX_CAPACITY, index->dirty = 1;
+}
+
+#define fwrite_fail(src, size, file) (fwrite(src, 1, size, file) != (size))
+/* Written next to the old one and renamed over it, so an interrupted run never leaves a broken index */
+static int index_save(struct library_index* index) {
+    if (!index->dirty)
+        return F5AR_OK;
+
+    char tmp_path[FILENAME_MAX + 4];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", index->path);
+
+    FILE* out = fopen(tmp_path, "wb");
+    if (!out)
+        return F5AR_FILEIO_ERR;
+
+    int err = F5AR_OK;
+    const uint8_t version = INDEX_VERSION;
+    const uint64_t count = index->size;
+    if (fwrite_fail(INDEX_MAGIC, 4, out) ||
+        fwrite_fail(&version, 1, out) ||
+        fwrite_fail(&count, sizeof(uint64_t), out))
+        err = F5AR_FILEIO_ERR;
+
+    for (size_t id = 0; id < index->size && !err; id++) {
+        const struct index_entry* entry = &index->entries[id];
+        const uint16_t path_len = (uint16_t) strlen(entry->path);
+        const uint64_t full = entry->capacity.full, shrinkable = entry->capacity.shrinkable;
+
+        if (fwrite_fail(&path_len, sizeof(uint16_t), out) ||
+            fwrite_fail(entry->path, path_len, out) ||
+            fwrite_fail(&entry->size, sizeof(uint64_t), out) ||
+            fwrite_fail(&entry->mtime, sizeof(int64_t), out) ||
+            fwrite_fail(&entry->mtime_nsec, sizeof(int64_t), out) ||
+            fwrite_fail(&entry->inode, sizeof(uint64_t), out) ||
+            fwrite_fail(&entry->flags, sizeof(uint8_t), out) ||
+            fwrite_fail(entry->hash, MD5_SIZE, out) ||
+            fwrite_fail(&full, sizeof(uint64_t), out) ||
+            fwrite_fail(&shrinkable, sizeof(uint64_t), out))
+            err = F5AR_FILEIO_ERR;
+    }
+
+    if (fclose(out) || err || rename(tmp_path, index->path)) {
+        remove(tmp_path);
+        return F5AR_FILEIO_ERR;
+    }
+
+    index->dirty = 0;
+    return F5AR_OK;
+}
+
+/* Forgets files the walk did not find, call it only after the walk went through the whole library */
+static int index_prune(struct library_index* index) {
+    size_t kept = 0;
+    for (size_t id = 0; id < index->size; id++) {
+        if (!index->entries[id].seen) {
+            free(index->entries[id].path);
+            continue;
+        }
+
+        index->entries[kept++] = index->entries[id];
+    }
+
+    if (kept == index->size)
+        return F5AR_OK;
+
+    index->size = kept, index->dirty = 1;
+    return index_rehash(index, index->slots_size);
+}
+
+static void index_free(struct library_index* index) {
+    for (size_t id = 0; id < index->size; id++)
+        free(index->entries[id].path);
+
+    free(index->entries), free(index->slots);
+    memset(index, 0, sizeof(struct library_index));
+}
+
+/* Remembers capacities found by f5ar_analyze() */
+static void index_store_capacities(struct library_index* index, f5archive* archive) {
+    f5ar_info info;
+    for (size_t id = 0; !f5ar_get_info(archive, id, &info); id++) {
+        struct index_entry* entry = info.path ? index_lookup(index, info.path) : NULL;
+        if (entry && info.analyzed && !(entry->flags & INDEX_CAPACITY))
+            index_set_capacity(index, entry, info.capacity);
+    }
+}
+
+/* Packing rewrote the used containers, their new hashes are known and capacities are not */
+static void index_store_packed(struct library_index* index, f5archive* archive) {
+    f5ar_info info;
+    for (size_t id = 0; !f5ar_get_info(archive, id, &info) && info.used; id++) {
+        struct index_entry* entry = info.path ? index_touch(index, info.path) : NULL;
+        if (!entry)
+            continue;
+
+        entry->flags = 0;
+        index_set_hash(index, entry, info.hash);
+    }
+}
@@ -36,7 +36,7 @@ int file_write(const char *path, const char *data, size_t size) {
     return 0;
 }
 
-void inline extract_dir_path(char* dest, const char* src) {
+static inline void extract_dir_path(char* dest, const char* src) {
     unsigned up_to = 0;
     for (unsigned j = 0; j < FILENAME_MAX && src[j]; ++j)
         if (src[j] == '/')
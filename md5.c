@@ -289,24 +289,78 @@ void md5_final(uint8_t *result, md5_ctx *ctx)
 }
 
 #include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * Files are read in large chunks, so md5_update() hands whole runs of blocks
+ * to body() and stdio copies nothing on the way.
+ */
+#define MD5_FILE_CHUNK (1 << 18)
+
+void md5_keep_last(uint8_t *last, const void *data, size_t size)
+{
+    const size_t keep = size < MD5_SIZE ? size : MD5_SIZE;
+    memmove(last, last + keep, MD5_SIZE - keep);
+    memcpy(last + MD5_SIZE - keep, (const uint8_t *)data + size - keep, keep);
+}
+
+/*
+ * Digest of the former md5_file(), which hashed 16-byte reads and always fed
+ * all 16 bytes, so a short final read was completed by stale bytes of the
+ * previous one. Data shorter than 16 bytes gets zeroes instead.
+ */
+void md5_final_legacy(uint8_t *result, md5_ctx *ctx, const uint8_t *last)
+{
+    const size_t rest = ctx->lo % MD5_SIZE;
+    if (rest)
+        md5_update(ctx, last, MD5_SIZE - rest);
+
+    md5_final(result, ctx);
+}
+
+static int md5_stream(FILE *file, md5_ctx *ctx, uint8_t *last)
+{
+    uint8_t *buff = malloc(MD5_FILE_CHUNK);
+    if (!buff)
+        return -1;
+
+    size_t read;
+    while ((read = fread(buff, 1, MD5_FILE_CHUNK, file)) > 0) {
+        md5_update(ctx, buff, read);
+
+        if (last)
+            md5_keep_last(last, buff, read);
+    }
+
+    free(buff);
+    return ferror(file) ? -1 : 0;
+}
+
 int md5_file(void *stream, void *dest) {
-    FILE* file = stream;
-    char buff[MD5_SIZE];
-    
     md5_ctx ctx;
     md5_init(&ctx);
-    
-    int c;
-    while ((c = fread(buff, 1, MD5_SIZE, file)) && c > 0)
-        md5_update(&ctx, buff, MD5_SIZE);
-    
-    if (c < 0)
-        return c;
+
+    if (md5_stream(stream, &ctx, NULL))
+        return -1;
 
     md5_final(dest, &ctx);
     return 0;
 }
 
+int md5_file_legacy(void *stream, void *dest) {
+    md5_ctx ctx;
+    md5_init(&ctx);
+
+    uint8_t last[MD5_SIZE];
+    memset(last, 0, MD5_SIZE);
+
+    if (md5_stream(stream, &ctx, last))
+        return -1;
+
+    md5_final_legacy(dest, &ctx, last);
+    return 0;
+}
+
 void md5_buffer(void *src, size_t size, void *dest) {
     md5_ctx ctx;
     md5_init(&ctx);
@@ -315,4 +369,230 @@ void md5_buffer(void *src, size_t size, void *dest) {
     md5_final(dest, &ctx);
 }
 
+/*
+ * Multi-buffer hashing: every SIMD lane runs its own message through the
+ * same rounds, a lane that finished its message picks up the next one.
+ */
+#define MD5_MAX_LANES 16
+
+struct md5_lane {
+    const uint8_t *data;
+    size_t blocks;
+
+    /* Last partial block with the padding and the length, one or two blocks */
+    uint8_t tail[128];
+    unsigned tail_blocks;
+    unsigned tail_used;
+
+    size_t id;
+};
+
+typedef void (*md5_lanes_fn)(uint32_t state[4][MD5_MAX_LANES], const uint8_t *const *blocks);
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MD5_LANES_X86
+
+static inline uint32_t load_le32(const uint8_t *src)
+{
+    uint32_t word;
+    memcpy(&word, src, sizeof(uint32_t));
+    return word;
+}
+
+#define MD5_ROUNDS(a, b, c, d, X) \
+	STEP(F, a, b, c, d, X[0], 0xd76aa478, 7) \
+	STEP(F, d, a, b, c, X[1], 0xe8c7b756, 12) \
+	STEP(F, c, d, a, b, X[2], 0x242070db, 17) \
+	STEP(F, b, c, d, a, X[3], 0xc1bdceee, 22) \
+	STEP(F, a, b, c, d, X[4], 0xf57c0faf, 7) \
+	STEP(F, d, a, b, c, X[5], 0x4787c62a, 12) \
+	STEP(F, c, d, a, b, X[6], 0xa8304613, 17) \
+	STEP(F, b, c, d, a, X[7], 0xfd469501, 22) \
+	STEP(F, a, b, c, d, X[8], 0x698098d8, 7) \
+	STEP(F, d, a, b, c, X[9], 0x8b44f7af, 12) \
+	STEP(F, c, d, a, b, X[10], 0xffff5bb1, 17) \
+	STEP(F, b, c, d, a, X[11], 0x895cd7be, 22) \
+	STEP(F, a, b, c, d, X[12], 0x6b901122, 7) \
+	STEP(F, d, a, b, c, X[13], 0xfd987193, 12) \
+	STEP(F, c, d, a, b, X[14], 0xa679438e, 17) \
+	STEP(F, b, c, d, a, X[15], 0x49b40821, 22) \
+	STEP(G, a, b, c, d, X[1], 0xf61e2562, 5) \
+	STEP(G, d, a, b, c, X[6], 0xc040b340, 9) \
+	STEP(G, c, d, a, b, X[11], 0x265e5a51, 14) \
+	STEP(G, b, c, d, a, X[0], 0xe9b6c7aa, 20) \
+	STEP(G, a, b, c, d, X[5], 0xd62f105d, 5) \
+	STEP(G, d, a, b, c, X[10], 0x02441453, 9) \
+	STEP(G, c, d, a, b, X[15], 0xd8a1e681, 14) \
+	STEP(G, b, c, d, a, X[4], 0xe7d3fbc8, 20) \
+	STEP(G, a, b, c, d, X[9], 0x21e1cde6, 5) \
+	STEP(G, d, a, b, c, X[14], 0xc33707d6, 9) \
+	STEP(G, c, d, a, b, X[3], 0xf4d50d87, 14) \
+	STEP(G, b, c, d, a, X[8], 0x455a14ed, 20) \
+	STEP(G, a, b, c, d, X[13], 0xa9e3e905, 5) \
+	STEP(G, d, a, b, c, X[2], 0xfcefa3f8, 9) \
+	STEP(G, c, d, a, b, X[7], 0x676f02d9, 14) \
+	STEP(G, b, c, d, a, X[12], 0x8d2a4c8a, 20) \
+	STEP(H, a, b, c, d, X[5], 0xfffa3942, 4) \
+	STEP(H2, d, a, b, c, X[8], 0x8771f681, 11) \
+	STEP(H, c, d, a, b, X[11], 0x6d9d6122, 16) \
+	STEP(H2, b, c, d, a, X[14], 0xfde5380c, 23) \
+	STEP(H, a, b, c, d, X[1], 0xa4beea44, 4) \
+	STEP(H2, d, a, b, c, X[4], 0x4bdecfa9, 11) \
+	STEP(H, c, d, a, b, X[7], 0xf6bb4b60, 16) \
+	STEP(H2, b, c, d, a, X[10], 0xbebfbc70, 23) \
+	STEP(H, a, b, c, d, X[13], 0x289b7ec6, 4) \
+	STEP(H2, d, a, b, c, X[0], 0xeaa127fa, 11) \
+	STEP(H, c, d, a, b, X[3], 0xd4ef3085, 16) \
+	STEP(H2, b, c, d, a, X[6], 0x04881d05, 23) \
+	STEP(H, a, b, c, d, X[9], 0xd9d4d039, 4) \
+	STEP(H2, d, a, b, c, X[12], 0xe6db99e5, 11) \
+	STEP(H, c, d, a, b, X[15], 0x1fa27cf8, 16) \
+	STEP(H2, b, c, d, a, X[2], 0xc4ac5665, 23) \
+	STEP(I, a, b, c, d, X[0], 0xf4292244, 6) \
+	STEP(I, d, a, b, c, X[7], 0x432aff97, 10) \
+	STEP(I, c, d, a, b, X[14], 0xab9423a7, 15) \
+	STEP(I, b, c, d, a, X[5], 0xfc93a039, 21) \
+	STEP(I, a, b, c, d, X[12], 0x655b59c3, 6) \
+	STEP(I, d, a, b, c, X[3], 0x8f0ccc92, 10) \
+	STEP(I, c, d, a, b, X[10], 0xffeff47d, 15) \
+	STEP(I, b, c, d, a, X[1], 0x85845dd1, 21) \
+	STEP(I, a, b, c, d, X[8], 0x6fa87e4f, 6) \
+	STEP(I, d, a, b, c, X[15], 0xfe2ce6e0, 10) \
+	STEP(I, c, d, a, b, X[6], 0xa3014314, 15) \
+	STEP(I, b, c, d, a, X[13], 0x4e0811a1, 21) \
+	STEP(I, a, b, c, d, X[4], 0xf7537e82, 6) \
+	STEP(I, d, a, b, c, X[11], 0xbd3af235, 10) \
+	STEP(I, c, d, a, b, X[2], 0x2ad7d2bb, 15) \
+	STEP(I, b, c, d, a, X[9], 0xeb86d391, 21)
+
+/*
+ * One block for every lane, the basic functions and STEP work on GCC vectors
+ * as they are, so every kernel is the same code compiled for its own ISA.
+ */
+#define MD5_LANES_KERNEL(name, width, isa) \
+typedef uint32_t name##_vec __attribute__((vector_size(4 * (width)))); \
+__attribute__((target(isa))) \
+static void name(uint32_t state[4][MD5_MAX_LANES], const uint8_t *const *blocks) \
+{ \
+	name##_vec X[16], a, b, c, d, saved_a, saved_b, saved_c, saved_d; \
+	for (unsigned j = 0; j < 16; j++) \
+		for (unsigned l = 0; l < (width); l++) \
+			X[j][l] = load_le32(blocks[l] + 4 * j); \
+\
+	memcpy(&a, state[0], sizeof(a)), memcpy(&b, state[1], sizeof(b)); \
+	memcpy(&c, state[2], sizeof(c)), memcpy(&d, state[3], sizeof(d)); \
+	saved_a = a, saved_b = b, saved_c = c, saved_d = d; \
+\
+	MD5_ROUNDS(a, b, c, d, X) \
+\
+	a += saved_a, b += saved_b, c += saved_c, d += saved_d; \
+	memcpy(state[0], &a, sizeof(a)), memcpy(state[1], &b, sizeof(b)); \
+	memcpy(state[2], &c, sizeof(c)), memcpy(state[3], &d, sizeof(d)); \
+}
+
+MD5_LANES_KERNEL(md5_lanes_sse2, 4, "sse2")
+MD5_LANES_KERNEL(md5_lanes_avx2, 8, "avx2")
+MD5_LANES_KERNEL(md5_lanes_avx512, 16, "avx512f")
+
+static unsigned md5_lanes_select(md5_lanes_fn *kernel)
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return *kernel = md5_lanes_avx512, 16;
+    if (__builtin_cpu_supports("avx2"))
+        return *kernel = md5_lanes_avx2, 8;
+    if (__builtin_cpu_supports("sse2"))
+        return *kernel = md5_lanes_sse2, 4;
+    return 0;
+}
+#endif
+
+static void md5_lane_load(struct md5_lane *lane, const void *data, size_t size, size_t id)
+{
+    const size_t rest = size & 0x3f;
+    const uint64_t bits = (uint64_t)size << 3;
+
+    lane->data = (const uint8_t *)data;
+    lane->blocks = size >> 6;
+    lane->id = id;
+
+    memset(lane->tail, 0, sizeof(lane->tail));
+    memcpy(lane->tail, lane->data + (size - rest), rest);
+    lane->tail[rest] = 0x80;
+
+    lane->tail_blocks = (rest < 56) ? 1 : 2;
+    lane->tail_used = 0;
+    for (unsigned i = 0; i < 8; i++)
+        lane->tail[64 * lane->tail_blocks - 8 + i] = (uint8_t)(bits >> (8 * i));
+}
+
+static const uint8_t *md5_lane_next(struct md5_lane *lane)
+{
+    if (lane->blocks) {
+        const uint8_t *block = lane->data;
+        lane->data += 64, lane->blocks--;
+        return block;
+    }
+
+    return lane->tail + 64 * lane->tail_used++;
+}
+
+void md5_buffers_batch(const void *const *srcs, const size_t *sizes, size_t count, void *dests)
+{
+    md5_lanes_fn kernel = NULL;
+    unsigned width = 0;
+#ifdef MD5_LANES_X86
+    width = md5_lanes_select(&kernel);
+#endif
+
+    /* A single message gains nothing from the lanes */
+    if (!width || count < 2) {
+        for (size_t i = 0; i < count; i++)
+            md5_buffer((void *)srcs[i], sizes[i], (uint8_t *)dests + i * MD5_SIZE);
+        return;
+    }
+
+    static const uint8_t idle[64];
+    struct md5_lane lanes[MD5_MAX_LANES];
+    uint32_t state[4][MD5_MAX_LANES];
+    const uint8_t *blocks[MD5_MAX_LANES];
+
+    size_t next = 0;
+    unsigned active = 0;
+    for (unsigned l = 0; l < width; l++) {
+        lanes[l].id = SIZE_MAX;
+        if (next < count) {
+            md5_lane_load(&lanes[l], srcs[next], sizes[next], next), next++, active++;
+            state[0][l] = 0x67452301, state[1][l] = 0xefcdab89;
+            state[2][l] = 0x98badcfe, state[3][l] = 0x10325476;
+        }
+    }
+
+    while (active) {
+        for (unsigned l = 0; l < width; l++)
+            blocks[l] = (lanes[l].id != SIZE_MAX) ? md5_lane_next(&lanes[l]) : idle;
+
+        kernel(state, blocks);
+
+        for (unsigned l = 0; l < width; l++) {
+            struct md5_lane *lane = &lanes[l];
+            if (lane->id == SIZE_MAX || lane->blocks || lane->tail_used < lane->tail_blocks)
+                continue;
+
+            uint8_t *result = (uint8_t *)dests + lane->id * MD5_SIZE;
+            OUT(&result[0], state[0][l])
+            OUT(&result[4], state[1][l])
+            OUT(&result[8], state[2][l])
+            OUT(&result[12], state[3][l])
+
+            if (next < count) {
+                md5_lane_load(lane, srcs[next], sizes[next], next), next++;
+                state[0][l] = 0x67452301, state[1][l] = 0xefcdab89;
+                state[2][l] = 0x98badcfe, state[3][l] = 0x10325476;
+            } else
+                lane->id = SIZE_MAX, active--;
+        }
+    }
+}
+
 #endif
\ No newline at end of file
@@ -44,7 +44,17 @@ void md5_init(md5_ctx *ctx);
 void md5_update(md5_ctx *ctx, const void *data, size_t size);
 void md5_final(uint8_t *result, md5_ctx *ctx);
 
+/* Streaming form of md5_file_legacy(), last holds the last MD5_SIZE bytes of the data
+ * kept by md5_keep_last() over a zeroed array */
+void md5_keep_last(uint8_t *last, const void *data, size_t size);
+void md5_final_legacy(uint8_t *result, md5_ctx *ctx, const uint8_t *last);
+
 int md5_file(void *stream, void *dest);
+int md5_file_legacy(void *stream, void *dest);
 void md5_buffer(void *src, size_t size, void *dest);
 
+/* Hashes count buffers at once using as many SIMD lanes as the CPU has,
+ * dest receives MD5_SIZE bytes for every buffer in the same order */
+void md5_buffers_batch(const void *const *srcs, const size_t *sizes, size_t count, void *dest);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,86 @@
+/*
+* Throughput of the MD5 routines used for library hashing
+* Usage: md5_bench [file]..., a 64 MB temporary file is hashed if none given
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "md5.h"
+
+#define BENCH_SIZE (64 << 20)
+#define BENCH_BUFFERS 64
+
+static double seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, size_t bytes, double spent) {
+    printf("%-20s %8.1f MB/s\n", name, bytes / spent / (1 << 20));
+}
+
+static size_t bench_file(const char *name, int (*hash)(void *, void *), FILE **files, int count) {
+    char digest[MD5_SIZE];
+    size_t bytes = 0;
+
+    const double begin = seconds();
+    for (int i = 0; i < count; i++) {
+        fseek(files[i], 0, SEEK_END), bytes += ftell(files[i]), fseek(files[i], 0, SEEK_SET);
+        hash(files[i], digest);
+    }
+
+    report(name, bytes, seconds() - begin);
+    return bytes;
+}
+
+int main(int argc, char *argv[]) {
+    const int count = argc > 1 ? argc - 1 : 1;
+    FILE **files = malloc(sizeof(FILE *) * count);
+
+    if (argc > 1) {
+        for (int i = 0; i < count; i++)
+            if (!(files[i] = fopen(argv[i + 1], "rb"))) {
+                fprintf(stderr, "Could not open %s\n", argv[i + 1]);
+                return 1;
+            }
+    } else {
+        files[0] = tmpfile();
+        for (size_t i = 0; i < BENCH_SIZE; i++)
+            fputc((int) (i * 2654435761u >> 24), files[0]);
+    }
+
+    /* First pass warms the page cache up */
+    bench_file("md5_file (cold)", md5_file, files, count);
+    bench_file("md5_file", md5_file, files, count);
+    bench_file("md5_file_legacy", md5_file_legacy, files, count);
+
+    const size_t size = BENCH_SIZE / BENCH_BUFFERS;
+    void *buffers[BENCH_BUFFERS];
+    size_t sizes[BENCH_BUFFERS];
+    for (int i = 0; i < BENCH_BUFFERS; i++) {
+        buffers[i] = malloc(size), sizes[i] = size;
+        memset(buffers[i], i, size);
+    }
+
+    char digests[BENCH_BUFFERS][MD5_SIZE];
+    double begin = seconds();
+    for (int i = 0; i < BENCH_BUFFERS; i++)
+        md5_buffer(buffers[i], sizes[i], digests[i]);
+    report("md5_buffer", BENCH_SIZE, seconds() - begin);
+
+    begin = seconds();
+    md5_buffers_batch((const void *const *) buffers, sizes, BENCH_BUFFERS, digests);
+    report("md5_buffers_batch", BENCH_SIZE, seconds() - begin);
+
+    for (int i = 0; i < BENCH_BUFFERS; i++)
+        free(buffers[i]);
+    for (int i = 0; i < count; i++)
+        fclose(files[i]);
+    free(files);
+
+    return 0;
+}
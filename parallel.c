@@ -0,0 +1,159 @@
+#include <pthread.h>
+#include <unistd.h>
+
+/* Every task gets the id of a worker running it (0 <= worker < threads) and its own id */
+typedef void (*task_fn)(void *arg, unsigned worker, size_t id);
+
+/* Workers live as long as the archive, so every parallel_for() call reuses them along with their scratch
+* A new job is announced by bumping the generation, the calling thread works on it as worker 0 */
+struct parallel_pool {
+    pthread_t* handles;
+    unsigned threads;
+    unsigned started;
+
+    task_fn fn;
+    void *arg;
+
+    size_t count;
+    size_t next;
+
+    /* Helpers still working on the current job */
+    unsigned busy;
+    uint64_t generation;
+    bool running;
+    bool stop;
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake, done;
+};
+
+struct parallel_helper {
+    struct parallel_pool *pool;
+    unsigned id;
+};
+
+/* Takes tasks until there are none left, call it holding the lock */
+static void parallel_drain(struct parallel_pool *pool, unsigned worker) {
+    while (pool->next < pool->count) {
+        const size_t id = pool->next++;
+
+        pthread_mutex_unlock(&pool->lock);
+        pool->fn(pool->arg, worker, id);
+        pthread_mutex_lock(&pool->lock);
+    }
+}
+
+static void *parallel_worker_run(void *arg) {
+    struct parallel_helper *helper = arg;
+    struct parallel_pool *pool = helper->pool;
+    uint64_t seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while (true) {
+        while (!pool->stop && pool->generation == seen)
+            pthread_cond_wait(&pool->wake, &pool->lock);
+
+        if (pool->stop)
+            break;
+
+        seen = pool->generation;
+        parallel_drain(pool, helper->id);
+
+        if (--pool->busy == 0)
+            pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    free(helper);
+    return NULL;
+}
+
+static unsigned parallel_threads_online(void) {
+    const long online = sysconf(_SC_NPROCESSORS_ONLN);
+    return online > 0 ? (unsigned) online : 1;
+}
+
+/* Starts threads - 1 helpers, the pool still works with fewer of them if some could not be started */
+static int parallel_pool_init(struct parallel_pool *pool, unsigned threads) {
+    memset(pool, 0, sizeof(struct parallel_pool));
+
+    if (pthread_mutex_init(&pool->lock, NULL))
+        return F5AR_FAILURE;
+    if (pthread_cond_init(&pool->wake, NULL)) {
+        pthread_mutex_destroy(&pool->lock);
+        return F5AR_FAILURE;
+    }
+    if (pthread_cond_init(&pool->done, NULL)) {
+        pthread_cond_destroy(&pool->wake), pthread_mutex_destroy(&pool->lock);
+        return F5AR_FAILURE;
+    }
+
+    pool->threads = threads;
+    if (threads > 1 && !(pool->handles = malloc(sizeof(pthread_t) * (threads - 1))))
+        return F5AR_OK;
+
+    while (pool->started + 1 < threads) {
+        struct parallel_helper *helper = malloc(sizeof(struct parallel_helper));
+        if (!helper)
+            break;
+
+        helper->pool = pool, helper->id = pool->started + 1;
+        if (pthread_create(&pool->handles[pool->started], NULL, parallel_worker_run, helper)) {
+            free(helper);
+            break;
+        }
+        pool->started++;
+    }
+
+    return F5AR_OK;
+}
+
+static void parallel_pool_free(struct parallel_pool *pool) {
+    if (!pool->threads)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (unsigned i = 0; i < pool->started; i++)
+        pthread_join(pool->handles[i], NULL);
+
+    pthread_cond_destroy(&pool->done), pthread_cond_destroy(&pool->wake), pthread_mutex_destroy(&pool->lock);
+    free(pool->handles);
+    memset(pool, 0, sizeof(struct parallel_pool));
+}
+
+/* Runs fn for every id in [0, count) on the pool workers, calling thread included
+* Tasks are handed out one by one, so containers of different sizes balance themselves
+* Calls made while the pool is busy or failed to start run their tasks on the calling thread */
+static int parallel_for(struct parallel_pool *pool, size_t count, task_fn fn, void *arg) {
+    bool serial = !pool->threads;
+    if (!serial) {
+        pthread_mutex_lock(&pool->lock);
+        serial = !pool->started || count <= 1 || pool->running;
+        pool->running |= !serial;
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    if (serial) {
+        for (size_t id = 0; id < count; id++)
+            fn(arg, 0, id);
+        return F5AR_OK;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->fn = fn, pool->arg = arg,
+    pool->count = count, pool->next = 0,
+    pool->busy = pool->started, pool->generation++;
+    pthread_cond_broadcast(&pool->wake);
+
+    parallel_drain(pool, 0);
+    while (pool->busy)
+        pthread_cond_wait(&pool->done, &pool->lock);
+
+    pool->running = false;
+    pthread_mutex_unlock(&pool->lock);
+    return F5AR_OK;
+}
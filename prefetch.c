@@ -0,0 +1,400 @@
+/* Reads whole files ahead of the workers taking them in order, keeping up to depth reads in flight
+* io_uring is used when the kernel has it, every file is read by a blocking read() otherwise.
+* At most window files are read and not taken yet, taking a file passes its buffer to the caller */
+
+#include <errno.h>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+/* IORING_OP_READ is an enum, headers having it are told by the feature flag added along with it */
+#if defined(__linux__) && defined(__NR_io_uring_setup) && defined(IORING_FEAT_RW_CUR_POS)
+#define PREFETCH_URING
+#endif
+
+/* Path of the file id, NULL if the file should not be read */
+typedef const char* (*prefetch_path_fn)(void *arg, size_t id);
+
+enum PREFETCH_STATE { PREFETCH_PENDING, PREFETCH_READY, PREFETCH_TAKEN };
+
+struct prefetch_file {
+    unsigned char* data;
+    size_t size;
+
+    /* Bytes read so far and the descriptor, while the read is in flight */
+    size_t done;
+    int fd;
+
+    uint8_t state;
+};
+
+#ifdef PREFETCH_URING
+struct prefetch_uring {
+    int fd;
+
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+
+    void *sq_ptr, *cq_ptr;
+    size_t sq_size, cq_size, sqes_size;
+};
+#endif
+
+struct prefetch {
+    prefetch_path_fn path;
+    void* arg;
+
+    struct prefetch_file* files;
+    size_t count;
+
+    unsigned depth;
+    size_t window;
+
+    size_t next;
+    size_t taken;
+    unsigned in_flight;
+    bool stop;
+
+#ifdef PREFETCH_URING
+    struct prefetch_uring ring;
+    bool uring;
+#endif
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+#ifdef PREFETCH_URING
+static int prefetch_uring_init(struct prefetch_uring* ring, unsigned depth) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    ring->fd = (int) syscall(__NR_io_uring_setup, depth, &params);
+    if (ring->fd < 0)
+        return F5AR_FAILURE;
+
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    /* Both rings share a single mapping on kernels able to do that */
+    const bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single)
+        ring->sq_size = ring->cq_size = (ring->sq_size > ring->cq_size) ? ring->sq_size : ring->cq_size;
+
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ptr = single ? ring->sq_ptr : mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+                                               MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+
+    if (ring->sq_ptr == MAP_FAILED || ring->cq_ptr == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        if (ring->sqes != MAP_FAILED)
+            munmap(ring->sqes, ring->sqes_size);
+        if (!single && ring->cq_ptr != MAP_FAILED)
+            munmap(ring->cq_ptr, ring->cq_size);
+        if (ring->sq_ptr != MAP_FAILED)
+            munmap(ring->sq_ptr, ring->sq_size);
+
+        close(ring->fd), ring->fd = -1;
+        return F5AR_FAILURE;
+    }
+
+    char* sq = ring->sq_ptr;
+    ring->sq_head = (unsigned*) (sq + params.sq_off.head),
+    ring->sq_tail = (unsigned*) (sq + params.sq_off.tail),
+    ring->sq_mask = (unsigned*) (sq + params.sq_off.ring_mask),
+    ring->sq_array = (unsigned*) (sq + params.sq_off.array);
+
+    char* cq = ring->cq_ptr;
+    ring->cq_head = (unsigned*) (cq + params.cq_off.head),
+    ring->cq_tail = (unsigned*) (cq + params.cq_off.tail),
+    ring->cq_mask = (unsigned*) (cq + params.cq_off.ring_mask),
+    ring->cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+
+    return F5AR_OK;
+}
+
+static void prefetch_uring_free(struct prefetch_uring* ring) {
+    if (ring->fd < 0)
+        return;
+
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ptr != ring->sq_ptr)
+        munmap(ring->cq_ptr, ring->cq_size);
+    munmap(ring->sq_ptr, ring->sq_size);
+    close(ring->fd);
+}
+
+/* Queues the read of whatever is left of the file, the ring is never fuller than depth */
+static int prefetch_uring_submit(struct prefetch_uring* ring, struct prefetch_file* file, size_t id) {
+    const unsigned tail = *ring->sq_tail;
+    const unsigned index = tail & *ring->sq_mask;
+
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+
+    /* Large files are read in several goes, the kernel could cap a single read anyway */
+    const size_t left = file->size - file->done;
+    sqe->opcode = IORING_OP_READ,
+    sqe->fd = file->fd,
+    sqe->addr = (uint64_t) (uintptr_t) (file->data + file->done),
+    sqe->len = (uint32_t) (left < (1U << 30) ? left : (1U << 30)),
+    sqe->off = file->done,
+    sqe->user_data = id;
+
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    return syscall(__NR_io_uring_enter, ring->fd, 1, 0, 0, NULL, 0) == 1 ? F5AR_OK : F5AR_FAILURE;
+}
+
+/* Waits for a completion, returns the id of the file and the result of its read */
+static int prefetch_uring_reap(struct prefetch_uring* ring, size_t* id, int* res) {
+    unsigned head = *ring->cq_head;
+    while (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        if (syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+            return F5AR_FAILURE;
+
+    const struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+    *id = (size_t) cqe->user_data, *res = cqe->res;
+
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return F5AR_OK;
+}
+#endif
+
+/* Call it holding the lock */
+static void prefetch_ready(struct prefetch* pf, struct prefetch_file* file, bool failed) {
+    if (file->fd >= 0)
+        close(file->fd), file->fd = -1;
+
+    /* Unreadable or truncated files are left to the usual way of reading, which reports them properly */
+    if (failed || file->done != file->size)
+        free(file->data), file->data = NULL, file->size = 0;
+
+    file->state = PREFETCH_READY;
+    pthread_cond_broadcast(&pf->cond);
+}
+
+/* Reads the rest of the file, the ring could have read some of it already */
+static void prefetch_read(struct prefetch_file* file) {
+    if (lseek(file->fd, (off_t) file->done, SEEK_SET) < 0)
+        return;
+
+    while (file->done < file->size) {
+        const ssize_t got = read(file->fd, file->data + file->done, file->size - file->done);
+        if (got <= 0 && !(got < 0 && errno == EINTR))
+            return;
+
+        file->done += got > 0 ? (size_t) got : 0;
+    }
+}
+
+/* Opens the file and allocates its buffer, returns false if there is nothing to read */
+static bool prefetch_open(struct prefetch* pf, struct prefetch_file* file, size_t id) {
+    const char* path = pf->path(pf->arg, id);
+    if (!path || (file->fd = open(path, O_RDONLY)) < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(file->fd, &st) || st.st_size <= 0 || !(file->data = malloc((size_t) st.st_size)))
+        return false;
+
+    file->size = (size_t) st.st_size;
+    return true;
+}
+
+#ifdef PREFETCH_URING
+/* Ring is broken, so buffers of the reads in flight are given up to the kernel and the rest is read the blocking way
+* Call it holding the lock */
+static void prefetch_abandon(struct prefetch* pf) {
+    for (size_t id = 0; id < pf->next; id++)
+        if (pf->files[id].state == PREFETCH_PENDING && pf->files[id].fd >= 0)
+            pf->files[id].data = NULL, pf->files[id].size = 0, prefetch_ready(pf, &pf->files[id], true);
+
+    pf->uring = false, pf->in_flight = 0;
+}
+#endif
+
+static void* prefetch_run(void* arg) {
+    struct prefetch* pf = arg;
+
+    pthread_mutex_lock(&pf->lock);
+    while (!pf->stop) {
+        /* Every file up to the window is either read now or queued */
+        while (!pf->stop && pf->next < pf->count && pf->next < pf->taken + pf->window && pf->in_flight < pf->depth) {
+            struct prefetch_file* file = &pf->files[pf->next];
+            const size_t id = pf->next++;
+
+            pthread_mutex_unlock(&pf->lock);
+            const bool opened = prefetch_open(pf, file, id);
+
+#ifdef PREFETCH_URING
+            if (opened && pf->uring) {
+                pthread_mutex_lock(&pf->lock);
+                if (!prefetch_uring_submit(&pf->ring, file, id)) {
+                    pf->in_flight++;
+                    continue;
+                }
+
+                /* Reads already queued are still reaped */
+                pf->uring = false;
+                pthread_mutex_unlock(&pf->lock);
+            }
+#endif
+            if (opened)
+                prefetch_read(file);
+
+            pthread_mutex_lock(&pf->lock);
+            prefetch_ready(pf, file, !opened);
+        }
+
+        if (pf->stop)
+            break;
+
+#ifdef PREFETCH_URING
+        if (pf->in_flight) {
+            pthread_mutex_unlock(&pf->lock);
+
+            size_t id;
+            int res;
+            const int err = prefetch_uring_reap(&pf->ring, &id, &res);
+
+            pthread_mutex_lock(&pf->lock);
+            if (err) {
+                prefetch_abandon(pf);
+                continue;
+            }
+
+            struct prefetch_file* file = &pf->files[id];
+            file->done += res > 0 ? (size_t) res : 0;
+
+            /* Old kernels without the read opcode are left for read() */
+            if (res == -EINVAL) {
+                pf->uring = false;
+                pthread_mutex_unlock(&pf->lock);
+                prefetch_read(file);
+                pthread_mutex_lock(&pf->lock);
+            } else if (res > 0 && file->done < file->size && pf->uring && !prefetch_uring_submit(&pf->ring, file, id))
+                continue;
+
+            pf->in_flight--;
+            prefetch_ready(pf, file, res < 0 && res != -EINVAL);
+            continue;
+        }
+#endif
+
+        if (pf->next == pf->count)
+            break;
+
+        pthread_cond_wait(&pf->cond, &pf->lock);
+    }
+
+    /* Whoever waits for the files never read gets nothing */
+    for (size_t id = pf->next; id < pf->count; id++)
+        pf->files[id].state = PREFETCH_READY;
+
+    pthread_cond_broadcast(&pf->cond);
+    pthread_mutex_unlock(&pf->lock);
+    return NULL;
+}
+
+/* Starts reading files [0, count) in the background */
+static int prefetch_start(struct prefetch* pf, size_t count, prefetch_path_fn path, void* arg, unsigned depth) {
+    memset(pf, 0, sizeof(struct prefetch));
+    pf->path = path, pf->arg = arg, pf->count = count;
+    pf->depth = depth, pf->window = 2 * (size_t) depth;
+
+    if (!(pf->files = calloc(count ? count : 1, sizeof(struct prefetch_file))))
+        return F5AR_MALLOC_ERR;
+
+    for (size_t id = 0; id < count; id++)
+        pf->files[id].fd = -1;
+
+#ifdef PREFETCH_URING
+    pf->uring = !prefetch_uring_init(&pf->ring, depth);
+    if (!pf->uring)
+        pf->ring.fd = -1;
+#endif
+
+    if (pthread_mutex_init(&pf->lock, NULL))
+        goto FAIL;
+    if (pthread_cond_init(&pf->cond, NULL)) {
+        pthread_mutex_destroy(&pf->lock);
+        goto FAIL;
+    }
+    if (pthread_create(&pf->thread, NULL, prefetch_run, pf)) {
+        pthread_cond_destroy(&pf->cond), pthread_mutex_destroy(&pf->lock);
+        goto FAIL;
+    }
+
+    return F5AR_OK;
+
+    FAIL:
+#ifdef PREFETCH_URING
+    prefetch_uring_free(&pf->ring);
+#endif
+    free(pf->files), pf->files = NULL;
+    return F5AR_FAILURE;
+}
+
+/* Waits for the file and hands its bytes over, NULL if it was not read */
+static unsigned char* prefetch_take(struct prefetch* pf, size_t id, size_t* size) {
+    pthread_mutex_lock(&pf->lock);
+    while (pf->files[id].state == PREFETCH_PENDING)
+        pthread_cond_wait(&pf->cond, &pf->lock);
+
+    unsigned char* data = NULL;
+    if (pf->files[id].state == PREFETCH_READY) {
+        data = pf->files[id].data, *size = pf->files[id].size;
+        pf->files[id].data = NULL, pf->files[id].state = PREFETCH_TAKEN;
+
+        pf->taken++;
+        pthread_cond_broadcast(&pf->cond);
+    }
+
+    pthread_mutex_unlock(&pf->lock);
+    return data;
+}
+
+/* Waits for the reads in flight and frees every file not taken */
+static void prefetch_stop(struct prefetch* pf) {
+    pthread_mutex_lock(&pf->lock);
+    pf->stop = true;
+    pthread_cond_broadcast(&pf->cond);
+    pthread_mutex_unlock(&pf->lock);
+
+    pthread_join(pf->thread, NULL);
+
+#ifdef PREFETCH_URING
+    /* Buffers of reads still in flight belong to the kernel until they complete */
+    while (pf->in_flight) {
+        size_t id;
+        int res;
+        if (prefetch_uring_reap(&pf->ring, &id, &res))
+            break;
+
+        if (pf->files[id].fd >= 0)
+            close(pf->files[id].fd), pf->files[id].fd = -1;
+        pf->in_flight--;
+    }
+
+    prefetch_uring_free(&pf->ring);
+#endif
+
+    for (size_t id = 0; id < pf->count; id++) {
+        if (pf->files[id].fd >= 0)
+            close(pf->files[id].fd);
+        free(pf->files[id].data);
+    }
+
+    pthread_cond_destroy(&pf->cond), pthread_mutex_destroy(&pf->lock);
+    free(pf->files);
+}
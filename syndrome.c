@@ -0,0 +1,131 @@
+/* Syndrome of a group is XOR of 1-based positions of its odd coefficients
+* Parities are gathered into 64-bit words by the best kernel the CPU has,
+* then every byte of a word is folded with a precomputed table */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SYNDROME_X86
+#include <immintrin.h>
+#endif
+
+/* syndrome_lut[q][b] is XOR of 8q + r over every bit r set in b */
+static uint8_t syndrome_lut[8][256];
+
+static uint64_t parity64_scalar(const JCOEF *a) {
+    uint64_t word = 0;
+    for (unsigned i = 0; i < 64; i++)
+        word |= (uint64_t) (a[i] & 1) << i;
+    return word;
+}
+
+#ifdef SYNDROME_X86
+__attribute__((target("sse2")))
+static uint64_t parity64_sse2(const JCOEF *a) {
+    uint64_t word = 0;
+    for (unsigned i = 0; i < 64; i += 16) {
+        const __m128i lo = _mm_slli_epi16(_mm_loadu_si128((const __m128i*) (a + i)), 15);
+        const __m128i hi = _mm_slli_epi16(_mm_loadu_si128((const __m128i*) (a + i + 8)), 15);
+
+        word |= (uint64_t) (uint16_t) _mm_movemask_epi8(_mm_packs_epi16(lo, hi)) << i;
+    }
+    return word;
+}
+
+__attribute__((target("avx2")))
+static uint64_t parity64_avx2(const JCOEF *a) {
+    uint64_t word = 0;
+    for (unsigned i = 0; i < 64; i += 32) {
+        const __m256i lo = _mm256_slli_epi16(_mm256_loadu_si256((const __m256i*) (a + i)), 15);
+        const __m256i hi = _mm256_slli_epi16(_mm256_loadu_si256((const __m256i*) (a + i + 16)), 15);
+
+        /* Packing works within 128-bit lanes, so put quarters back in order */
+        const __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi16(lo, hi), 0xD8);
+        word |= (uint64_t) (uint32_t) _mm256_movemask_epi8(packed) << i;
+    }
+    return word;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static uint64_t parity64_avx512(const JCOEF *a) {
+    const __m512i one = _mm512_set1_epi16(1);
+
+    const uint32_t lo = _mm512_test_epi16_mask(_mm512_loadu_si512((const void*) a), one);
+    const uint32_t hi = _mm512_test_epi16_mask(_mm512_loadu_si512((const void*) (a + 32)), one);
+
+    return (uint64_t) lo | (uint64_t) hi << 32;
+}
+#endif
+
+static uint64_t (*parity64)(const JCOEF *) = parity64_scalar;
+
+static pthread_once_t syndrome_once = PTHREAD_ONCE_INIT;
+
+static void syndrome_setup(void) {
+    for (unsigned q = 0; q < 8; q++)
+        for (unsigned b = 0; b < 256; b++)
+            for (unsigned r = 0; r < 8; r++)
+                syndrome_lut[q][b] ^= (b & (1 << r)) ? 8 * q + r : 0;
+
+#ifdef SYNDROME_X86
+    /* Kernels rely on JCOEF being 16-bit wide */
+    if (sizeof(JCOEF) != 2)
+        return;
+
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw"))
+        parity64 = parity64_avx512;
+    else if (__builtin_cpu_supports("avx2"))
+        parity64 = parity64_avx2;
+    else if (__builtin_cpu_supports("sse2"))
+        parity64 = parity64_sse2;
+#endif
+}
+
+static void syndrome_init(void) {
+    pthread_once(&syndrome_once, syndrome_setup);
+}
+
+/* Bit r of word stands for the position base + r, base is a multiple of 64 */
+static inline unsigned syndrome_word(uint64_t word, size_t base) {
+    uint64_t odd = word;
+    for (unsigned shift = 32; shift; shift >>= 1)
+        odd ^= odd >> shift;
+
+    unsigned hash = (odd & 1) ? (unsigned) base : 0;
+    for (unsigned q = 0; q < 8; q++, word >>= 8)
+        hash ^= syndrome_lut[q][word & 0xFF];
+
+    return hash;
+}
+
+/* Takes parities of the group 64 at a time, shifting every word by one
+* as positions are 1-based and the word base should stay a multiple of 64 */
+struct syndrome_acc {
+    unsigned hash;
+    uint64_t carry;
+    size_t base;
+};
+
+static inline void syndrome_feed(struct syndrome_acc *acc, uint64_t word) {
+    acc->hash ^= syndrome_word((word << 1) | acc->carry, acc->base);
+    acc->carry = word >> 63, acc->base += 64;
+}
+
+static inline unsigned syndrome_done(struct syndrome_acc *acc) {
+    return acc->hash ^ (acc->carry ? (unsigned) acc->base : 0);
+}
+
+static unsigned f5ex(const JCOEF *a, size_t n) {
+    struct syndrome_acc acc = {0, 0, 0};
+
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64)
+        syndrome_feed(&acc, parity64(a + i));
+
+    uint64_t tail = 0;
+    for (unsigned r = 0; i + r < n; r++)
+        tail |= (uint64_t) (a[i + r] & 1) << r;
+
+    if (i < n)
+        syndrome_feed(&acc, tail);
+    return syndrome_done(&acc);
+}